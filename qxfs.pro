@@ -17,12 +17,44 @@ DEFINES += QXFS_LIBRARY
 
 CONFIG += c++11
 
+# Counts the heap allocations of the decode, dispatch and send paths, see
+# QXfsStatistics; replaces the global operator new of the process.
+qxfs_allocation_accounting {
+    DEFINES += QXFS_ALLOCATION_ACCOUNTING
+
+    # Counts through malloc(), calloc() and realloc() instead, which Qt
+    # containers allocate with; replaces them process-wide (glibc only).
+    qxfs_malloc_hooks {
+        DEFINES += QXFS_MALLOC_HOOKS
+    }
+}
+
 SOURCES += \
+    qxfscapabilityflags.cpp \
+    qxfscashunits.cpp \
+    qxfsclock.cpp \
+    qxfsconnection.cpp \
+    qxfsfaultdevice.cpp \
+    qxfsjournal.cpp \
+    qxfslog.cpp \
     qxfssocketstream.cpp \
+    qxfsstateboard.cpp \
+    qxfsstatistics.cpp \
     qxfsstream.cpp
 
 HEADERS += \
+    qxfscapabilityflags.h \
+    qxfscashunits.h \
+    qxfsclock.h \
+    qxfsconnection_p.h \
+    qxfsfaultdevice.h \
+    qxfsjournal_p.h \
+    qxfslog.h \
+    qxfssnapshot_p.h \
     qxfssocketstream.h \
+    qxfsstateboard.h \
+    qxfsstatistics.h \
+    qxfsstatistics_p.h \
     qxfsstream.h \
 
 
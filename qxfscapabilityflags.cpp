@@ -0,0 +1,169 @@
+#include <QStringList>
+
+#include "qxfscapabilityflags.h"
+
+/**
+ * @brief Descriptor entry mapping one capability value to a flag bit.
+ *
+ * Entries without a token describe boolean fields; the others describe one
+ * value of a flag word, by symbolic name and by numeric mask.
+ */
+struct QXfsCapabilityBit
+{
+    const char *field;
+    const char *token;
+    quint32 mask;
+    int flag;
+};
+
+static const QXfsCapabilityBit cdmDescriptor[] =
+{
+    {"bCompound", nullptr, 0, QXfsCapabilityFlags::CdmCompound},
+    {"bShutter", nullptr, 0, QXfsCapabilityFlags::CdmShutter},
+    {"bShutterControl", nullptr, 0, QXfsCapabilityFlags::CdmShutterControl},
+    {"bSafeDoor", nullptr, 0, QXfsCapabilityFlags::CdmSafeDoor},
+    {"bCashBox", nullptr, 0, QXfsCapabilityFlags::CdmCashBox},
+    {"bIntermediateStacker", nullptr, 0,
+     QXfsCapabilityFlags::CdmIntermediateStacker},
+    {"bItemsTakenSensor", nullptr, 0,
+     QXfsCapabilityFlags::CdmItemsTakenSensor},
+    {"fwRetractAreas", "WFS_CDM_RA_RETRACT", 0x0001,
+     QXfsCapabilityFlags::CdmRetractToRetract},
+    {"fwRetractAreas", "WFS_CDM_RA_TRANSPORT", 0x0002,
+     QXfsCapabilityFlags::CdmRetractToTransport},
+    {"fwRetractAreas", "WFS_CDM_RA_STACKER", 0x0004,
+     QXfsCapabilityFlags::CdmRetractToStacker},
+    {"fwRetractAreas", "WFS_CDM_RA_REJECT", 0x0008,
+     QXfsCapabilityFlags::CdmRetractToReject},
+    {"fwRetractAreas", "WFS_CDM_RA_NOTSUPP", 0x0010,
+     QXfsCapabilityFlags::CdmRetractNotSupported},
+    {"fwPositions", "WFS_CDM_POSLEFT", 0x0001,
+     QXfsCapabilityFlags::CdmPositionLeft},
+    {"fwPositions", "WFS_CDM_POSRIGHT", 0x0002,
+     QXfsCapabilityFlags::CdmPositionRight},
+    {"fwPositions", "WFS_CDM_POSCENTER", 0x0004,
+     QXfsCapabilityFlags::CdmPositionCenter},
+    {"fwPositions", "WFS_CDM_POSTOP", 0x0040,
+     QXfsCapabilityFlags::CdmPositionTop},
+    {"fwPositions", "WFS_CDM_POSBOTTOM", 0x0080,
+     QXfsCapabilityFlags::CdmPositionBottom},
+    {"fwPositions", "WFS_CDM_POSFRONT", 0x0800,
+     QXfsCapabilityFlags::CdmPositionFront},
+    {"fwPositions", "WFS_CDM_POSREAR", 0x1000,
+     QXfsCapabilityFlags::CdmPositionRear},
+    {"fwMoveItems", "WFS_CDM_FROMCU", 0x0001,
+     QXfsCapabilityFlags::CdmMoveFromCashUnit},
+    {"fwMoveItems", "WFS_CDM_TOCU", 0x0002,
+     QXfsCapabilityFlags::CdmMoveToCashUnit},
+    {"fwMoveItems", "WFS_CDM_TOTRANSPORT", 0x0004,
+     QXfsCapabilityFlags::CdmMoveToTransport},
+    {"fwMoveItems", "WFS_CDM_TOSTACKER", 0x0008,
+     QXfsCapabilityFlags::CdmMoveToStacker},
+    {nullptr, nullptr, 0, 0}
+};
+
+static const QXfsCapabilityBit ptrDescriptor[] =
+{
+    {"bCompound", nullptr, 0, QXfsCapabilityFlags::PtrCompound},
+    {"bAcceptMedia", nullptr, 0, QXfsCapabilityFlags::PtrAcceptMedia},
+    {"bMultiPage", nullptr, 0, QXfsCapabilityFlags::PtrMultiPage},
+    {"bMediaTaken", nullptr, 0, QXfsCapabilityFlags::PtrMediaTaken},
+    {"bDispensePaper", nullptr, 0, QXfsCapabilityFlags::PtrDispensePaper},
+    {"fwControl", "WFS_PTR_CTRLEJECT", 0x0001,
+     QXfsCapabilityFlags::PtrControlEject},
+    {"fwControl", "WFS_PTR_CTRLPERFORATE", 0x0002,
+     QXfsCapabilityFlags::PtrControlPerforate},
+    {"fwControl", "WFS_PTR_CTRLCUT", 0x0004,
+     QXfsCapabilityFlags::PtrControlCut},
+    {"fwControl", "WFS_PTR_CTRLSKIP", 0x0008,
+     QXfsCapabilityFlags::PtrControlSkip},
+    {"fwControl", "WFS_PTR_CTRLFLUSH", 0x0010,
+     QXfsCapabilityFlags::PtrControlFlush},
+    {"fwControl", "WFS_PTR_CTRLRETRACT", 0x0020,
+     QXfsCapabilityFlags::PtrControlRetract},
+    {"fwControl", "WFS_PTR_CTRLSTACK", 0x0040,
+     QXfsCapabilityFlags::PtrControlStack},
+    {"fwControl", "WFS_PTR_CTRLPARTIALCUT", 0x0080,
+     QXfsCapabilityFlags::PtrControlPartialCut},
+    {"fwControl", "WFS_PTR_CTRLALARM", 0x0100,
+     QXfsCapabilityFlags::PtrControlAlarm},
+    {"fwControl", "WFS_PTR_CTRLATPFORWARD", 0x0200,
+     QXfsCapabilityFlags::PtrControlForward},
+    {"fwControl", "WFS_PTR_CTRLATPBACKWARD", 0x0400,
+     QXfsCapabilityFlags::PtrControlBackward},
+    {"fwControl", "WFS_PTR_CTRLTURNMEDIA", 0x0800,
+     QXfsCapabilityFlags::PtrControlTurnMedia},
+    {"fwControl", "WFS_PTR_CTRLSTAMP", 0x1000,
+     QXfsCapabilityFlags::PtrControlStamp},
+    {"fwControl", "WFS_PTR_CTRLPARK", 0x2000,
+     QXfsCapabilityFlags::PtrControlPark},
+    {"fwControl", "WFS_PTR_CTRLEXPEL", 0x4000,
+     QXfsCapabilityFlags::PtrControlExpel},
+    {"fwControl", "WFS_PTR_CTRLEJECTTOTRANSPORT", 0x8000,
+     QXfsCapabilityFlags::PtrControlEjectToTransport},
+    {nullptr, nullptr, 0, 0}
+};
+
+static const QXfsCapabilityBit *
+descriptor(const QString &strClass)
+{
+    if (strClass == "CDM")
+        return cdmDescriptor;
+    else if (strClass == "PTR")
+        return ptrDescriptor;
+
+    return nullptr;
+}
+
+/**
+ * @brief Tests whether flag word @p value holds @p token / @p mask.
+ */
+static bool
+hasValue(const QVariant &value, const char *token, quint32 mask)
+{
+    switch (value.type())
+    {
+    case QVariant::String:
+        foreach (const QString &s, value.toString().split('|'))
+        {
+            if (s.trimmed() == token)
+                return true;
+        }
+
+        return false;
+    case QVariant::StringList:
+    case QVariant::List:
+        return value.toStringList().contains(token);
+    default:
+        return value.toULongLong() & mask;
+    }
+}
+
+QXfsCapabilityFlags
+QXfsCapabilityFlags::fromCapabilities(const QString &strClass,
+                                      const QVariantMap &caps)
+{
+    QXfsCapabilityFlags rv;
+    const QXfsCapabilityBit *bit = descriptor(strClass.toUpper());
+
+    rv.m_valid = true;
+
+    /* the enums of the classes share bit positions */
+    if (bit == cdmDescriptor)
+        rv.m_class = CdmClass;
+    else if (bit == ptrDescriptor)
+        rv.m_class = PtrClass;
+
+    for (; bit && bit->field; bit++)
+    {
+        const QVariant &value = caps.value(bit->field);
+
+        if (bit->token ? hasValue(value, bit->token, bit->mask)
+                       : value.toBool())
+        {
+            rv.m_bits |= Q_UINT64_C(1) << bit->flag;
+        }
+    }
+
+    return rv;
+}
@@ -0,0 +1,129 @@
+#ifndef QXFSCAPABILITYFLAGS_H
+#define QXFSCAPABILITYFLAGS_H
+
+#include <QVariantMap>
+
+#include "qxfs_global.h"
+
+/**
+ * @class QXfsCapabilityFlags
+ * @brief Capability map of a device compiled into a fixed bitset.
+ *
+ * @details
+ * Boolean capabilities and the individual values of flag words (e.g.
+ * PTR fwControl, CDM fwRetractAreas) are mapped to bits by a per device
+ * class descriptor once per capabilities refresh, so application code can
+ * test them in constant time instead of looking up and parsing the map
+ * before every transaction.
+ *
+ * Flag words are recognized as integer masks, symbolic value lists or
+ * symbolic values joined by '|'.
+ */
+class QXFS_EXPORT QXfsCapabilityFlags
+{
+public:
+    /**
+     * @brief Cash dispenser (CDM) capabilities.
+     */
+    enum Cdm
+    {
+        CdmCompound,
+        CdmShutter,
+        CdmShutterControl,
+        CdmSafeDoor,
+        CdmCashBox,
+        CdmIntermediateStacker,
+        CdmItemsTakenSensor,
+        CdmRetractToRetract,
+        CdmRetractToTransport,
+        CdmRetractToStacker,
+        CdmRetractToReject,
+        CdmRetractNotSupported,
+        CdmPositionLeft,
+        CdmPositionRight,
+        CdmPositionCenter,
+        CdmPositionTop,
+        CdmPositionBottom,
+        CdmPositionFront,
+        CdmPositionRear,
+        CdmMoveFromCashUnit,
+        CdmMoveToCashUnit,
+        CdmMoveToTransport,
+        CdmMoveToStacker
+    };
+
+    /**
+     * @brief Printer (PTR) capabilities.
+     */
+    enum Ptr
+    {
+        PtrCompound,
+        PtrAcceptMedia,
+        PtrMultiPage,
+        PtrMediaTaken,
+        PtrDispensePaper,
+        PtrControlEject,
+        PtrControlPerforate,
+        PtrControlCut,
+        PtrControlSkip,
+        PtrControlFlush,
+        PtrControlRetract,
+        PtrControlStack,
+        PtrControlPartialCut,
+        PtrControlAlarm,
+        PtrControlForward,
+        PtrControlBackward,
+        PtrControlTurnMedia,
+        PtrControlStamp,
+        PtrControlPark,
+        PtrControlExpel,
+        PtrControlEjectToTransport
+    };
+
+    QXfsCapabilityFlags() : m_bits(0), m_class(NoClass), m_valid(false) {}
+
+    /**
+     * @brief Compiles @p caps with the descriptor of device class
+     *        @p strClass (e.g. "CDM", "PTR").
+     *
+     * Classes without a descriptor yield valid but empty flags.
+     */
+    static QXfsCapabilityFlags fromCapabilities(const QString &strClass,
+                                                const QVariantMap &caps);
+
+    /**
+     * @brief True once built from a capabilities map.
+     */
+    bool isValid() const {return m_valid;}
+
+    /**
+     * @brief Tests a flag of the class the flags were built for; flags of
+     *        another class share the bits, and always test false.
+     */
+    bool test(Cdm flag) const {return testBit(CdmClass, flag);}
+    bool test(Ptr flag) const {return testBit(PtrClass, flag);}
+
+    quint64 bits() const {return m_bits;}
+
+private:
+    /**
+     * @brief Device classes with a descriptor.
+     */
+    enum Class
+    {
+        NoClass,
+        CdmClass,
+        PtrClass
+    };
+
+    bool testBit(Class c, int bit) const
+    {
+        return m_class == c && (m_bits & (Q_UINT64_C(1) << bit));
+    }
+
+    quint64 m_bits;
+    Class m_class;
+    bool m_valid;
+};
+
+#endif // QXFSCAPABILITYFLAGS_H
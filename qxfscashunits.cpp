@@ -0,0 +1,279 @@
+#include "qxfscashunits.h"
+#include "qxfssnapshot_p.h"
+
+/**
+ * @brief Category of the cash unit info query.
+ */
+static const char cashUnitInfo[] = "WFS_INF_CDM_CASH_UNIT_INFO";
+
+/**
+ * @brief Commands after which the units are queried again.
+ */
+static const char *const recountCommands[] =
+{
+    "WFS_CMD_CDM_END_EXCHANGE",
+    "WFS_CMD_CDM_SET_CASH_UNIT_INFO",
+    "WFS_CMD_CDM_CALIBRATE_CASH_UNIT",
+    "WFS_CMD_CDM_TEST_CASH_UNITS",
+    "WFS_CMD_CDM_COUNT",
+    "WFS_CMD_CDM_REJECT",
+    "WFS_CMD_CDM_RETRACT",
+    nullptr
+};
+
+QXfsCashUnits::QXfsCashUnits(QXfsStream *cdm, QObject *parent) :
+    QObject{parent},
+    m_cdm(cdm),
+    m_querying(false),
+    m_info(new QXfsSnapshot<QVariantMap>)
+{
+    connect(cdm, &QXfsStream::serviceEventRecieved,
+            this, &QXfsCashUnits::serviceEvent);
+    connect(cdm, &QXfsStream::userEventRecieved,
+            this, &QXfsCashUnits::userEvent);
+    connect(cdm, &QXfsStream::executeEventBroadcasted,
+            this, &QXfsCashUnits::executeFrame);
+    connect(cdm, &QXfsStream::systemEventRecieved,
+            this, &QXfsCashUnits::systemEvent);
+
+    query();
+}
+
+QXfsCashUnits::~QXfsCashUnits()
+{
+}
+
+bool
+QXfsCashUnits::refresh()
+{
+    return m_cdm && apply(m_cdm->getInfo(cashUnitInfo));
+}
+
+bool
+QXfsCashUnits::isValid() const
+{
+    return !m_info->load().isEmpty();
+}
+
+QVariantMap
+QXfsCashUnits::info() const
+{
+    return m_info->load();
+}
+
+QVariantList
+QXfsCashUnits::units() const
+{
+    return m_info->load()["lppList"].toList();
+}
+
+QVariantMap
+QXfsCashUnits::unit(int usNumber) const
+{
+    foreach (const QVariant &unit, units())
+    {
+        const QVariantMap &rv = unit.toMap();
+
+        if (rv["usNumber"].toInt() == usNumber)
+            return rv;
+    }
+
+    return QVariantMap();
+}
+
+qint64
+QXfsCashUnits::count(int usNumber) const
+{
+    const QVariantMap &rv = unit(usNumber);
+
+    return rv.contains("ulCount") ? rv["ulCount"].toLongLong() : -1;
+}
+
+quint64
+QXfsCashUnits::amount(const QString &currency) const
+{
+    quint64 rv = 0;
+
+    foreach (const QVariant &unit, units())
+    {
+        const QVariantMap &cu = unit.toMap();
+
+        if (cu["cCurrencyID"].toString() == currency)
+            rv += cu["ulValues"].toULongLong() * cu["ulCount"].toULongLong();
+    }
+
+    return rv;
+}
+
+void
+QXfsCashUnits::query()
+{
+    QPointer<QXfsCashUnits> self(this);
+
+    if (!m_cdm || m_querying)
+        return;
+
+    m_querying = true;
+
+    const QString &msgid = m_cdm->asyncGetInfo(cashUnitInfo, QVariant(),
+    [self](const QVariantMap &msg)
+    {
+        if (!self)
+            return;
+
+        self->m_querying = false;
+        self->apply(msg);
+    });
+
+    if (msgid.isEmpty())
+        m_querying = false;
+}
+
+bool
+QXfsCashUnits::apply(const QVariantMap &msg)
+{
+    if (msg["hResult"].toString() != "WFS_SUCCESS")
+        return false;
+
+    m_info->store(msg["lpBuffer"].toMap());
+    emit changed();
+
+    return true;
+}
+
+void
+QXfsCashUnits::replace(const QVariantMap &unit)
+{
+    QVariantMap info = m_info->load();
+    QVariantList list = info["lppList"].toList();
+
+    /* not built yet, the pending query brings it in */
+    if (info.isEmpty())
+        return;
+
+    for (int i = 0; i < list.size(); i++)
+    {
+        if (list[i].toMap()["usNumber"] == unit["usNumber"])
+        {
+            list[i] = unit;
+            info["lppList"] = list;
+            m_info->store(info);
+            emit changed();
+            return;
+        }
+    }
+
+    /* a unit we do not know of, start over */
+    query();
+}
+
+void
+QXfsCashUnits::dispensed(const QVariantMap &denomination)
+{
+    const QVariantList &values = denomination["lpulValues"].toList();
+    QVariantMap info = m_info->load();
+    QVariantList list = info["lppList"].toList();
+
+    if (info.isEmpty())
+        return;
+
+    for (int i = 0; i < qMin(values.size(), list.size()); i++)
+    {
+        const quint64 notes = values[i].toULongLong();
+        QVariantMap unit = list[i].toMap();
+
+        if (!notes)
+            continue;
+
+        unit["ulCount"] = unit["ulCount"].toULongLong() -
+                          qMin(unit["ulCount"].toULongLong(), notes);
+        unit["ulDispensedCount"] = unit["ulDispensedCount"].toULongLong() +
+                                   notes;
+        list[i] = unit;
+    }
+
+    info["lppList"] = list;
+    m_info->store(info);
+    emit changed();
+}
+
+void
+QXfsCashUnits::unitChanged(const QVariantMap &unit)
+{
+    QHash<QString, bool>::iterator it;
+
+    /* the event's counts are absolute and may already include the notes
+     * of a running dispense, which its completion must not take again
+     */
+    for (it = m_dispenses.begin(); it != m_dispenses.end(); ++it)
+        it.value() = true;
+
+    replace(unit);
+}
+
+void
+QXfsCashUnits::serviceEvent(const QVariantMap &msg)
+{
+    if (QXfsStream::eventId(msg) == "WFS_SRVE_CDM_CASHUNITINFOCHANGED")
+        unitChanged(msg["lpBuffer"].toMap());
+}
+
+void
+QXfsCashUnits::userEvent(const QVariantMap &msg)
+{
+    if (QXfsStream::eventId(msg) == "WFS_USRE_CDM_CASHUNITTHRESHOLD")
+        unitChanged(msg["lpBuffer"].toMap());
+}
+
+void
+QXfsCashUnits::executeFrame(const QVariantMap &msg, const QString &dwCommand)
+{
+    const QString &msgid = msg["msgid"].toString();
+
+    if (dwCommand == "WFS_CMD_CDM_DISPENSE")
+    {
+        /* the acknowledgement, the dispense is running */
+        if (!msg.contains("message") && msg["hResult"] == "WFS_SUCCESS")
+        {
+            m_dispenses.insert(msgid, false);
+            return;
+        }
+
+        if (msg.contains("message") && msg["message"] != "WFS_EXECUTE_COMPLETE")
+            return;
+
+        const bool changed = m_dispenses.take(msgid);
+
+        if (msg["hResult"] != "WFS_SUCCESS")
+            return;
+
+        if (changed)
+            query();
+        else
+            dispensed(msg["lpBuffer"].toMap());
+
+        return;
+    }
+
+    if (msg["message"] != "WFS_EXECUTE_COMPLETE" ||
+        msg["hResult"] != "WFS_SUCCESS")
+    {
+        return;
+    }
+
+    for (int i = 0; recountCommands[i]; i++)
+    {
+        if (dwCommand == recountCommands[i])
+        {
+            query();
+            return;
+        }
+    }
+}
+
+void
+QXfsCashUnits::systemEvent(const QVariantMap &msg)
+{
+    if (QXfsStream::eventId(msg) == "WFS_SYSE_DEVICE_STATUS")
+        query();
+}
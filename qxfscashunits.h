@@ -0,0 +1,146 @@
+#ifndef QXFSCASHUNITS_H
+#define QXFSCASHUNITS_H
+
+#include <QHash>
+#include <QPointer>
+#include <QScopedPointer>
+#include <QVariantMap>
+
+#include "qxfs_global.h"
+#include "qxfsstream.h"
+
+template <typename T> class QXfsSnapshot;
+
+/**
+ * @class QXfsCashUnits
+ * @brief Cash units of a dispenser, kept current from its traffic.
+ *
+ * @details
+ * Built from one WFS_INF_CDM_CASH_UNIT_INFO query, then maintained from
+ * what the observed proxy receives, with no further round-trips:
+ *  - WFS_SRVE_CDM_CASHUNITINFOCHANGED and WFS_USRE_CDM_CASHUNITTHRESHOLD
+ *    replace the unit they carry;
+ *  - successful WFS_CMD_CDM_DISPENSE completions, issued through any proxy
+ *    of the device, take the notes of their denomination (lpulValues, one
+ *    entry per unit of lppList) off ulCount and add them to
+ *    ulDispensedCount; if a unit was replaced while the dispense ran, its
+ *    counts may include the notes already, and the units are queried
+ *    again instead;
+ *  - commands that reset or recount the units (exchanges, calibration,
+ *    cash unit tests, setting the info, rejects, retracts) and device
+ *    status changes query the units again, in the background.
+ *
+ * Readers on any thread get a consistent copy without taking a lock, see
+ * QXfsSnapshot; count checks therefore cost no device round-trip.
+ */
+class QXFS_EXPORT QXfsCashUnits : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief Starts tracking the cash units of @p cdm, querying them in
+     *        the background.
+     *
+     * Must be created on the proxy's thread.
+     */
+    explicit QXfsCashUnits(QXfsStream *cdm, QObject *parent = nullptr);
+    ~QXfsCashUnits();
+
+    /**
+     * @brief Queries the cash units again, blocking like getInfo().
+     *
+     * @return bool False if the query failed; the model is unchanged.
+     */
+    bool refresh();
+
+    /**
+     * @brief True once the cash units have been queried.
+     */
+    bool isValid() const;
+
+    /**
+     * @brief Returns the cash unit info, i.e. the lpBuffer of the query
+     *        (usTellerID, usCount, lppList) with the updates applied.
+     */
+    QVariantMap info() const;
+
+    /**
+     * @brief Returns the units of lppList.
+     */
+    QVariantList units() const;
+
+    /**
+     * @brief Returns unit @p usNumber, empty if there is none.
+     */
+    QVariantMap unit(int usNumber) const;
+
+    /**
+     * @brief Returns the ulCount of unit @p usNumber, -1 if unknown.
+     */
+    qint64 count(int usNumber) const;
+
+    /**
+     * @brief Returns the value of the notes left in the units of
+     *        @p currency, i.e. the sum of ulValues times ulCount.
+     */
+    quint64 amount(const QString &currency) const;
+
+signals:
+    /**
+     * @brief Emitted, on the proxy's thread, after every update.
+     */
+    void changed();
+
+private slots:
+    void serviceEvent(const QVariantMap &msg);
+    void userEvent(const QVariantMap &msg);
+    void executeFrame(const QVariantMap &msg, const QString &dwCommand);
+    void systemEvent(const QVariantMap &msg);
+
+private:
+    /**
+     * @brief Queries the units without blocking.
+     */
+    void query();
+
+    /**
+     * @brief Publishes the query answer @p msg, if successful.
+     */
+    bool apply(const QVariantMap &msg);
+
+    /**
+     * @brief Replaces the unit of the same usNumber with @p unit.
+     */
+    void replace(const QVariantMap &unit);
+
+    /**
+     * @brief Takes the notes of a dispense off the units.
+     */
+    void dispensed(const QVariantMap &denomination);
+
+    /**
+     * @brief Notes that a unit changed during the running dispenses.
+     */
+    void unitChanged(const QVariantMap &unit);
+
+    QPointer<QXfsStream> m_cdm;
+
+    /**
+     * @brief True while a background query is outstanding.
+     */
+    bool m_querying;
+
+    /**
+     * @brief Dispenses acknowledged and not yet completed, mapped to true
+     *        once a unit event arrived meanwhile.
+     */
+    QHash<QString, bool> m_dispenses;
+
+    /**
+     * @brief Cash unit info, empty until first queried.
+     */
+    QScopedPointer<QXfsSnapshot<QVariantMap>> m_info;
+};
+
+#endif // QXFSCASHUNITS_H
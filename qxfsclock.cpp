@@ -0,0 +1,347 @@
+#include <QAbstractEventDispatcher>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QThread>
+
+#include <limits>
+
+#include "qxfsclock.h"
+
+/**
+ * @brief Bound of the event loop passes of QXfsSimulatedClock::settle(); a
+ *        zero timer re-armed in every pass never settles.
+ */
+static const int maxSettlePasses = 100000;
+
+/**
+ * @brief Clock installed with QXfsClock::install(), if any.
+ */
+static std::atomic<QXfsClock *> installedClock(nullptr);
+
+/**
+ * @brief System clock; deliberately never destroyed, unlike a global
+ *        static, so that code running at process teardown still has one.
+ */
+static QXfsClock *
+systemClock()
+{
+    static QXfsClock *clock = new QXfsClock;
+
+    return clock;
+}
+
+QXfsClock::QXfsClock()
+{
+    m_timer.start();
+}
+
+QXfsClock::~QXfsClock()
+{
+}
+
+QXfsClock *
+QXfsClock::instance()
+{
+    QXfsClock *clock = installedClock.load(std::memory_order_acquire);
+
+    return clock ? clock : systemClock();
+}
+
+void
+QXfsClock::install(QXfsClock *clock)
+{
+    installedClock.store(clock, std::memory_order_release);
+}
+
+qint64
+QXfsClock::nsecsElapsed() const
+{
+    return m_timer.nsecsElapsed();
+}
+
+qint64
+QXfsClock::msecsSinceEpoch() const
+{
+    return QDateTime::currentMSecsSinceEpoch();
+}
+
+bool
+QXfsClock::arm(QXfsTimer *timer, int msec)
+{
+    Q_UNUSED(timer);
+    Q_UNUSED(msec);
+
+    return false;
+}
+
+void
+QXfsClock::disarm(QXfsTimer *timer)
+{
+    Q_UNUSED(timer);
+}
+
+QXfsTimer::QXfsTimer(QObject *parent) :
+    QObject{parent},
+    m_timer(this),
+    m_clock(nullptr),
+    m_armed(false),
+    m_generation(0),
+    m_interval(0),
+    m_singleShot(false)
+{
+    connect(&m_timer, &QTimer::timeout, this, &QXfsTimer::timeout);
+}
+
+QXfsTimer::~QXfsTimer()
+{
+    stop();
+}
+
+void
+QXfsTimer::singleShot(int msec, QObject *context,
+                      const std::function<void()> &fn)
+{
+    QXfsTimer *timer = new QXfsTimer(context);
+
+    timer->setSingleShot(true);
+    connect(timer, &QXfsTimer::timeout, timer, [timer, fn]
+    {
+        timer->deleteLater();
+        fn();
+    });
+    timer->start(msec);
+}
+
+void
+QXfsTimer::setSingleShot(bool singleShot)
+{
+    m_singleShot = singleShot;
+    m_timer.setSingleShot(singleShot);
+}
+
+bool
+QXfsTimer::isActive() const
+{
+    return m_timer.isActive() || m_armed.load();
+}
+
+void
+QXfsTimer::start(int msec)
+{
+    QXfsClock *clock = QXfsClock::instance();
+
+    stop();
+    m_interval = msec;
+
+    if (!clock->arm(this, msec))
+        m_timer.start(msec);
+}
+
+void
+QXfsTimer::stop()
+{
+    /* an expiry already posted by a simulated clock is stale now */
+    m_generation++;
+    m_timer.stop();
+
+    if (QXfsClock *clock = m_clock.exchange(nullptr))
+        clock->disarm(this);
+}
+
+void
+QXfsTimer::expire(quint64 generation)
+{
+    if (generation != m_generation.load())
+        return;
+
+    if (!m_singleShot)
+        start(m_interval);
+
+    emit timeout();
+}
+
+QXfsSimulatedClock::QXfsSimulatedClock() :
+    m_now(systemClock()->nsecsElapsed()),
+    m_epoch(QDateTime::currentMSecsSinceEpoch() - m_now / 1000000),
+    m_sequence(0)
+{
+}
+
+QXfsSimulatedClock::~QXfsSimulatedClock()
+{
+    QXfsClock *self = this;
+
+    installedClock.compare_exchange_strong(self, nullptr);
+
+    QMutexLocker lock(&m_mutex);
+
+    /* the timers may live on other threads, hence the atomics; a timer
+     * stopped after this finds its clock cleared
+     */
+    foreach (const Armed &armed, m_timers)
+    {
+        armed.timer->m_armed = false;
+        armed.timer->m_clock = nullptr;
+    }
+}
+
+qint64
+QXfsSimulatedClock::nsecsElapsed() const
+{
+    return m_now.load();
+}
+
+qint64
+QXfsSimulatedClock::msecsSinceEpoch() const
+{
+    return m_epoch + m_now.load() / 1000000;
+}
+
+void
+QXfsSimulatedClock::settle()
+{
+    QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance();
+
+    for (int pass = 0; dispatcher && pass < maxSettlePasses; pass++)
+    {
+        /* outside of exec() only an explicit call deletes them, and every
+         * single shot timer leaves one
+         */
+        QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+
+        if (!dispatcher->processEvents(QEventLoop::AllEvents))
+            break;
+    }
+}
+
+void
+QXfsSimulatedClock::advance(qint64 msec)
+{
+    const qint64 now = m_now.load();
+    const qint64 until = now + qMin(qMax(msec, Q_INT64_C(0)),
+                                    (std::numeric_limits<qint64>::max() -
+                                     now) / 1000000) * 1000000;
+
+    settle();
+
+    while (fireNext(until))
+        settle();
+
+    QMutexLocker lock(&m_mutex);
+
+    if (m_now.load() < until)
+        m_now.store(until);
+}
+
+bool
+QXfsSimulatedClock::runUntil(const std::function<bool()> &done,
+                             qint64 limitMsec)
+{
+    QAbstractEventDispatcher *dispatcher = QAbstractEventDispatcher::instance();
+    const qint64 now = m_now.load();
+    const qint64 until = now + qMin(qMax(limitMsec, Q_INT64_C(0)),
+                                    (std::numeric_limits<qint64>::max() -
+                                     now) / 1000000) * 1000000;
+
+    settle();
+
+    while (!done())
+    {
+        if (fireNext(until))
+        {
+            settle();
+            continue;
+        }
+
+        if (pendingTimers() || !dispatcher)
+        {
+            /* the next timer lies beyond the limit */
+            QMutexLocker lock(&m_mutex);
+
+            m_now.store(qMax(m_now.load(), until));
+
+            return done();
+        }
+
+        dispatcher->processEvents(QEventLoop::WaitForMoreEvents);
+        settle();
+    }
+
+    return true;
+}
+
+int
+QXfsSimulatedClock::pendingTimers() const
+{
+    QMutexLocker lock(&m_mutex);
+
+    return m_timers.size();
+}
+
+bool
+QXfsSimulatedClock::arm(QXfsTimer *timer, int msec)
+{
+    QMutexLocker lock(&m_mutex);
+    const Key key(m_now.load() + qMax(msec, 0) * Q_INT64_C(1000000),
+                  m_sequence++);
+
+    m_timers.insert(key, {timer, timer->m_generation.load()});
+    m_keys.insert(timer, key);
+    timer->m_armed = true;
+    timer->m_clock = this;
+
+    return true;
+}
+
+void
+QXfsSimulatedClock::disarm(QXfsTimer *timer)
+{
+    QMutexLocker lock(&m_mutex);
+
+    if (m_keys.contains(timer))
+        m_timers.remove(m_keys.take(timer));
+
+    timer->m_armed = false;
+}
+
+bool
+QXfsSimulatedClock::fireNext(qint64 until)
+{
+    QMutexLocker lock(&m_mutex);
+
+    if (m_timers.isEmpty() || m_timers.firstKey().first > until)
+        return false;
+
+    const Key key = m_timers.firstKey();
+    const Armed armed = m_timers.take(key);
+    QXfsTimer *timer = armed.timer;
+    const quint64 generation = armed.generation;
+
+    m_keys.remove(timer);
+    timer->m_armed = false;
+
+    if (key.first > m_now.load())
+        m_now.store(key.first);
+
+    /* posted under the lock with the timer's clock still set, so a timer
+     * stopping or being destroyed meanwhile waits for the lock in
+     * disarm(); a timer destroyed before the event is delivered drops it
+     */
+    if (timer->thread() != QThread::currentThread())
+    {
+        QMetaObject::invokeMethod(timer, [timer, generation]
+        {
+            timer->expire(generation);
+        }, Qt::QueuedConnection);
+
+        timer->m_clock = nullptr;
+
+        return true;
+    }
+
+    timer->m_clock = nullptr;
+    lock.unlock();
+    timer->expire(generation);
+
+    return true;
+}
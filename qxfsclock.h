@@ -0,0 +1,241 @@
+#ifndef QXFSCLOCK_H
+#define QXFSCLOCK_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QPair>
+#include <QTimer>
+
+#include <atomic>
+#include <functional>
+
+#include "qxfs_global.h"
+
+class QXfsTimer;
+
+/**
+ * @class QXfsClock
+ * @brief Time source of every time-dependent feature of the library.
+ *
+ * @details
+ * Request latencies and server timings, negotiation and recovery timeouts,
+ * drain deadlines, log rate limiting and the delays of QXfsFaultDevice all
+ * read the installed clock and arm QXfsTimer; by default that is the
+ * system clock, and QXfsTimer is a plain QTimer.
+ *
+ * Installing a QXfsSimulatedClock replaces both with virtual time, so
+ * hours of timeouts and delays pass in as long as the traffic they cause
+ * takes.
+ */
+class QXFS_EXPORT QXfsClock
+{
+public:
+    QXfsClock();
+    virtual ~QXfsClock();
+
+    QXfsClock(const QXfsClock &) = delete;
+    QXfsClock &operator=(const QXfsClock &) = delete;
+
+    /**
+     * @brief Returns the installed clock, or the system clock; never
+     *        nullptr, not even while the process tears down.
+     */
+    static QXfsClock *instance();
+
+    /**
+     * @brief Installs @p clock, which the caller keeps owning; nullptr
+     *        restores the system clock.
+     *
+     * Install before creating the proxies: timers armed already stay on
+     * the clock they were armed on.
+     */
+    static void install(QXfsClock *clock);
+
+    /**
+     * @brief Monotonic time, in nanoseconds.
+     */
+    virtual qint64 nsecsElapsed() const;
+
+    /**
+     * @brief Wall clock time, in milliseconds since the epoch.
+     */
+    virtual qint64 msecsSinceEpoch() const;
+
+    /**
+     * @brief Monotonic time, in milliseconds.
+     */
+    qint64 elapsed() const {return nsecsElapsed() / 1000000;}
+
+protected:
+    friend class QXfsTimer;
+
+    /**
+     * @brief Arms @p timer to expire in @p msec.
+     *
+     * @return bool False to leave it to the timer's QTimer, as the system
+     *         clock does; clocks returning true set the timer's clock.
+     */
+    virtual bool arm(QXfsTimer *timer, int msec);
+    virtual void disarm(QXfsTimer *timer);
+
+private:
+    QElapsedTimer m_timer;
+};
+
+/**
+ * @class QXfsTimer
+ * @brief QTimer running on the installed QXfsClock.
+ */
+class QXFS_EXPORT QXfsTimer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit QXfsTimer(QObject *parent = nullptr);
+    virtual ~QXfsTimer();
+
+    /**
+     * @brief Calls @p fn after @p msec, unless @p context is destroyed
+     *        first; to be called on the thread of @p context.
+     */
+    static void singleShot(int msec, QObject *context,
+                           const std::function<void()> &fn);
+
+    void setSingleShot(bool singleShot);
+    bool isSingleShot() const {return m_singleShot;}
+    bool isActive() const;
+
+    void start(int msec);
+    void stop();
+
+signals:
+    void timeout();
+
+private:
+    friend class QXfsSimulatedClock;
+
+    /**
+     * @brief Expiry on a simulated clock; stale unless @p generation is
+     *        that of the current start().
+     */
+    void expire(quint64 generation);
+
+    QTimer m_timer;
+
+    /**
+     * @brief Clock the timer is armed on, if not its QTimer; set and
+     *        cleared by the clock, which may run on another thread.
+     */
+    std::atomic<QXfsClock *> m_clock;
+    std::atomic<bool> m_armed;
+    std::atomic<quint64> m_generation;
+
+    int m_interval;
+    bool m_singleShot;
+};
+
+/**
+ * @class QXfsSimulatedClock
+ * @brief Virtual time, advanced by a simulation driver.
+ *
+ * @details
+ * Time stands still until the driver advances it. advance() then jumps
+ * from one armed timer to the next, in the order they are due (and armed,
+ * for equal deadlines), and between two timers runs the events of the
+ * calling thread until there are none left, so whatever a timeout causes
+ * (frames written, answers read, timers armed) happens at that virtual
+ * instant. A day of executes against the mock server of qxfs-bench runs
+ * in the time the frames take to go through the local sockets.
+ *
+ * Runs reproduce exactly when the proxies, the server and the driver share
+ * one thread, and with no more than one other thread blocking on requests;
+ * timers of other threads fire through their event loops.
+ *
+ * @code
+ * QXfsSimulatedClock clock;
+ *
+ * QXfsClock::install(&clock);
+ * ...
+ * clock.advance(24 * 3600 * 1000);
+ * @endcode
+ *
+ * Must outlive the timers armed on it, i.e. be destroyed after the proxies.
+ */
+class QXFS_EXPORT QXfsSimulatedClock : public QXfsClock
+{
+public:
+    /**
+     * @brief Starts at the current time of the system clock.
+     */
+    QXfsSimulatedClock();
+
+    /**
+     * @brief Restores the system clock if installed.
+     */
+    virtual ~QXfsSimulatedClock();
+
+    virtual qint64 nsecsElapsed() const;
+    virtual qint64 msecsSinceEpoch() const;
+
+    /**
+     * @brief Runs the events of the calling thread until none is left.
+     */
+    void settle();
+
+    /**
+     * @brief Lets @p msec of virtual time pass, firing the timers due
+     *        meanwhile.
+     */
+    void advance(qint64 msec);
+
+    /**
+     * @brief Advances time timer by timer until @p done returns true or
+     *        @p limitMsec passed.
+     *
+     * With no timer armed, waits for events posted by other threads.
+     *
+     * @return bool What @p done returned last.
+     */
+    bool runUntil(const std::function<bool()> &done, qint64 limitMsec);
+
+    /**
+     * @brief Returns the number of timers armed.
+     */
+    int pendingTimers() const;
+
+protected:
+    virtual bool arm(QXfsTimer *timer, int msec);
+    virtual void disarm(QXfsTimer *timer);
+
+private:
+    using Key = QPair<qint64, quint64>;
+
+    struct Armed
+    {
+        QXfsTimer *timer;
+        quint64 generation;
+    };
+
+    /**
+     * @brief Fires the first timer due by @p until, moving time to it.
+     *
+     * @return bool False if there is none.
+     */
+    bool fireNext(qint64 until);
+
+    mutable QMutex m_mutex;
+    std::atomic<qint64> m_now;
+
+    /**
+     * @brief Wall clock time when the monotonic time was 0.
+     */
+    qint64 m_epoch;
+    quint64 m_sequence;
+
+    QMap<Key, Armed> m_timers;
+    QHash<QXfsTimer *, Key> m_keys;
+};
+
+#endif // QXFSCLOCK_H
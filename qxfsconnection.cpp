@@ -0,0 +1,1744 @@
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QMultiHash>
+#include <QRunnable>
+#include <QSysInfo>
+#include <QThread>
+#include <QThreadPool>
+#include <QUuid>
+#include <QtEndian>
+
+#include "qxfsclock.h"
+#include "qxfsconnection_p.h"
+#include "qxfslog.h"
+#include "qxfsstatistics_p.h"
+#include "qxfsstream.h"
+
+using QXfsConnectionMap = QMultiHash<QString, QWeakPointer<QXfsConnection>>;
+
+/**
+ * @brief Global registry of shared connections.
+ */
+Q_GLOBAL_STATIC(QXfsConnectionMap, connections)
+
+/**
+ * @brief Mutex protecting connection registry.
+ */
+Q_GLOBAL_STATIC(QMutex, connectionMutex)
+
+/**
+ * @brief Thread pool decoding frames of connections in parallel mode.
+ */
+Q_GLOBAL_STATIC(QThreadPool, decodePool)
+
+/**
+ * @brief Frames below this size are decoded inline, as handing them to the
+ *        pool costs more than decoding them.
+ */
+static const int parallelDecodeThreshold = 4096;
+
+/**
+ * @brief Largest length-prefixed frame accepted; a larger prefix is taken
+ *        for a corrupt stream.
+ */
+static const quint32 maxFrameSize = 64 * 1024 * 1024;
+
+/**
+ * @brief Version of the negotiation protocol spoken in the hello frame.
+ */
+static const int protocolVersion = 1;
+
+/**
+ * @brief Default time to wait for the server's answer to the hello.
+ */
+static const int defaultNegotiationTimeout = 1000;
+
+/**
+ * @brief Time the server has to answer the completion lookup after a
+ *        reconnection before the requests set aside are failed.
+ */
+static const int recoveryTimeout = 10000;
+
+/**
+ * @brief Time a reconnection attempt of recover() may block the
+ *        connection's thread.
+ */
+static const int reconnectTimeout = 2000;
+
+/**
+ * @brief Delay before the first retry of a failed reconnection, doubled
+ *        for each further one, and the number of retries.
+ */
+static const int reconnectBackoff = 250;
+static const int maxReconnectRetries = 5;
+
+/**
+ * @brief lpCmdData fields from this size on (bytes or characters) go
+ *        through the server's payload cache.
+ */
+static const int cachedPayloadThreshold = 4096;
+
+/**
+ * @brief Payload hashes remembered per connection before starting over.
+ */
+static const int maxCachedPayloads = 1024;
+
+/**
+ * @brief Frames decoded off-thread, waiting to be dispatched in order.
+ */
+struct QXfsDecodeQueue
+{
+    QMutex mutex;
+
+    /**
+     * @brief Owning connection; cleared under the mutex when it is gone.
+     */
+    QXfsConnection *connection;
+
+    /**
+     * @brief Decoded frames keyed by sequence number; corrupt ones empty.
+     */
+    QMap<quint64, QVariantMap> decoded;
+
+    bool flushScheduled;
+
+    QSharedPointer<QXfsDeviceStatistics> statistics;
+};
+
+/**
+ * @brief Decodes one length-prefixed frame on the decode pool.
+ */
+class QXfsDecodeTask : public QRunnable
+{
+public:
+    QXfsDecodeTask(const QSharedPointer<QXfsDecodeQueue> &queue,
+                   quint64 seq, const QByteArray &frame,
+                   QDataStream::ByteOrder byteOrder, bool compressed) :
+        m_queue(queue),
+        m_seq(seq),
+        m_frame(frame),
+        m_byteOrder(byteOrder),
+        m_compressed(compressed)
+    {
+    }
+
+    virtual void run()
+    {
+        QXfsAllocationScope scope(m_queue->statistics.data(),
+                                  QXfsStatistics::DecodeAllocations);
+        QVariantMap msg;
+
+        {
+            QXfsStageTimer timer(m_queue->statistics.data(),
+                                 QXfsStatistics::DecodeStage);
+
+            msg = decode(m_frame, m_byteOrder, m_compressed);
+        }
+
+        QMutexLocker lock(&m_queue->mutex);
+
+        m_queue->decoded.insert(m_seq, msg);
+
+        /* posted under the mutex, so the connection is still alive; should
+         * it be destroyed before the event is delivered, Qt discards it
+         */
+        if (m_queue->connection && !m_queue->flushScheduled)
+        {
+            QXfsConnection *connection = m_queue->connection;
+
+            m_queue->flushScheduled = true;
+            QMetaObject::invokeMethod(connection, [connection]
+            {
+                connection->flushDecoded();
+            }, Qt::QueuedConnection);
+        }
+    }
+
+    static QVariantMap decode(const QByteArray &frame,
+                              QDataStream::ByteOrder byteOrder,
+                              bool compressed)
+    {
+        QVariantMap msg;
+        QDataStream ds(compressed ? qUncompress(frame) : frame);
+
+        ds.setByteOrder(byteOrder);
+        ds >> msg;
+
+        return ds.status() == QDataStream::Ok ? msg : QVariantMap();
+    }
+
+private:
+    QSharedPointer<QXfsDecodeQueue> m_queue;
+    quint64 m_seq;
+    QByteArray m_frame;
+    QDataStream::ByteOrder m_byteOrder;
+    bool m_compressed;
+};
+
+QXfsConnection::QXfsConnection(QIODevice *io, const QString &deviceId,
+                               QObject *parent) :
+    QXfsConnection(deviceId, parent)
+{
+    setIo(io);
+}
+
+QXfsConnection::QXfsConnection(const QString &deviceId, QObject *parent) :
+    QObject{parent},
+    m_io(nullptr),
+    m_directCount(0),
+    m_lastDirectId(0),
+    m_dispatchScheduled(false),
+    m_configuredFraming(QXfsStream::LegacyFraming),
+    m_framing(QXfsStream::LegacyFraming),
+    m_byteOrder(QDataStream::BigEndian),
+    m_compression(false),
+    m_counterIds(false),
+    m_lastId(0),
+    m_negotiationTimeout(defaultNegotiationTimeout),
+    m_negotiationDue(false),
+    m_legacyPeer(false),
+    m_helloSent(0),
+    m_negotiationTimer(this),
+    m_recoveryDue(false),
+    m_reconnectAttempts(0),
+    m_serverTiming(false),
+    m_clockOffset(0),
+    m_clockError(0),
+    m_parallelDecoding(false),
+    m_migrating(false),
+    m_wasConnected(false),
+    m_connected(false),
+    m_decodeQueue(new QXfsDecodeQueue),
+    m_decodeSeq(0),
+    m_dispatchSeq(0),
+    m_statistics(QXfsDeviceStatistics::device(deviceId))
+{
+    setObjectName(deviceId);
+
+    m_features = legacyFeatures();
+    m_decodeQueue->connection = this;
+    m_decodeQueue->flushScheduled = false;
+    m_decodeQueue->statistics = m_statistics;
+
+    m_negotiationTimer.setSingleShot(true);
+
+    /* a late answer costs the connection, see accept() */
+    connect(&m_negotiationTimer, &QXfsTimer::timeout, this, [this]
+    {
+        m_legacyPeer = true;
+        QXfsLog::log(QXfsLog::Info, "negotiate/" + objectName(),
+                     QString("%1 - no answer to hello within %2 ms, "
+                             "using the legacy protocol")
+                     .arg(objectName()).arg(m_negotiationTimeout),
+                     {{"device", objectName()}});
+        negotiated();
+    });
+
+    /* connected before any proxy, which must see the requests set aside */
+    connect(this, &QXfsConnection::disconnected, this, [this]
+    {
+        m_statistics->disconnects.fetch_add(1, std::memory_order_relaxed);
+        lost();
+    });
+}
+
+QXfsConnection::~QXfsConnection()
+{
+    {
+        QMutexLocker lock(&m_decodeQueue->mutex);
+
+        m_decodeQueue->connection = nullptr;
+    }
+
+    /* take what is left of this connection off the device's gauges */
+    qint64 queued = 0;
+
+    for (int l = CompletionLane; l < LaneCount; l++)
+        queued += m_lanes[l].size();
+
+    m_statistics->queueDepth.fetch_sub(queued, std::memory_order_relaxed);
+    m_statistics->inFlight.fetch_sub(m_pending.size(),
+                                     std::memory_order_relaxed);
+}
+
+void
+QXfsConnection::setIo(QIODevice *io)
+{
+    m_io = io;
+
+    if (!m_io)
+        return;
+
+    /* a socket may have connected before it was handed over */
+    m_wasConnected = m_io->isOpen();
+    m_connected = m_io->isOpen();
+    m_negotiationDue = m_io->isOpen();
+
+    connect(m_io, SIGNAL(readyRead()), SLOT(readyRead()));
+
+    /* sockets and transport decorators report a lost connection, any other
+     * transport is lost when closed; queued, so what the requests failed
+     * meanwhile do next does not run inside close()
+     */
+    if (m_io->metaObject()->indexOfSignal("disconnected()") != -1)
+        connect(m_io, SIGNAL(disconnected()), SLOT(transportLost()));
+
+    connect(m_io, SIGNAL(aboutToClose()), SLOT(transportClosed()),
+            Qt::QueuedConnection);
+
+    if (m_io->metaObject()->indexOfSignal("connected()") != -1)
+        connect(m_io, SIGNAL(connected()), SLOT(transportConnected()));
+}
+
+bool
+QXfsConnection::open(int msecs)
+{
+    Q_UNUSED(msecs);
+
+    if (!m_io)
+        return false;
+
+    if (m_io->isOpen())
+        return true;
+
+    if (!m_io->open(QIODevice::ReadWrite))
+    {
+        const QString device = objectName();
+        const QString error = m_io->errorString();
+
+        QXfsLog::warning("connect/" + device,
+                         [device, error](QString &text, QVariantMap &fields)
+        {
+            text = QString("%1 - unable to reopen transport: %2")
+                   .arg(device, error);
+            fields = {{"device", device}, {"error", error}};
+        });
+        return false;
+    }
+
+    /* transports with a connected() signal may have reported already */
+    if (!m_connected)
+        transportConnected();
+
+    return true;
+}
+
+void
+QXfsConnection::transportConnected()
+{
+    if (m_wasConnected)
+        m_statistics->reconnects.fetch_add(1, std::memory_order_relaxed);
+
+    m_wasConnected = true;
+    m_connected = true;
+    m_negotiationDue = true;
+}
+
+void
+QXfsConnection::transportLost()
+{
+    /* sockets report both losing the peer and closing */
+    if (!m_connected)
+        return;
+
+    m_connected = false;
+
+    emit disconnected();
+}
+
+void
+QXfsConnection::transportClosed()
+{
+    /* reopened before the queued notification arrived */
+    if (m_io->isOpen())
+        return;
+
+    transportLost();
+}
+
+QVariantMap
+QXfsConnection::legacyFeatures() const
+{
+    return
+    {
+        {"negotiated", false},
+        {"version", 0},
+        {"codec", "qdatastream"},
+        {"byteOrder", "big"},
+        {"framing", m_configuredFraming == QXfsStream::LengthPrefixedFraming
+                    ? "length" : "legacy"},
+        {"compression", "none"},
+        {"idFormat", "uuid"},
+        {"multiplexing", false},
+        {"idempotency", false},
+        {"timing", false},
+        {"payloadCache", false}
+    };
+}
+
+void
+QXfsConnection::negotiate()
+{
+    if (!m_negotiationDue)
+        return;
+
+    /* the server starts every connection in the legacy protocol; frames
+     * held for a previous one died with it
+     */
+    m_negotiationDue = false;
+    m_negotiationTimer.stop();
+    m_held.clear();
+    m_framing = m_configuredFraming;
+    m_byteOrder = QDataStream::BigEndian;
+    m_compression = false;
+    m_counterIds = false;
+    m_serverTiming = false;
+    m_features = legacyFeatures();
+    m_helloId.clear();
+
+    if (m_legacyPeer || m_negotiationTimeout <= 0)
+        return;
+
+    /* offers are listed in order of preference */
+    QStringList byteOrders {"big", "little"};
+    QStringList framings {"length", "legacy"};
+
+    if (QSysInfo::ByteOrder == QSysInfo::LittleEndian)
+        byteOrders = QStringList {"little", "big"};
+
+    if (m_configuredFraming == QXfsStream::LegacyFraming)
+        framings = QStringList {"legacy", "length"};
+
+    QVariantMap offer
+    {
+        {"codec", QStringList {"qdatastream"}},
+        {"byteOrder", byteOrders},
+        {"framing", framings},
+        {"compression", QStringList {"none", "zlib"}},
+        {"idFormat", QStringList {"uuid", "counter"}},
+        {"multiplexing", QVariantList {false}},
+        {"idempotency", QVariantList {true, false}},
+        {"timing", QVariantList {true, false}},
+        {"payloadCache", QVariantList {true, false}}
+    };
+
+    m_helloId = QUuid::createUuid().toString();
+    m_helloSent = QXfsDeviceStatistics::now();
+    write({{"function", "WFSHello"},
+           {"msgid", m_helloId},
+           {"version", protocolVersion},
+           {"features", offer}});
+
+    /* the answer is picked out of the inbound stream by readyRead(); no
+     * blocking for it, which under a simulated clock would never time out
+     */
+    m_negotiationTimer.start(m_negotiationTimeout);
+}
+
+bool
+QXfsConnection::accept(const QVariantMap &msg)
+{
+    if (m_helloId.isEmpty() || msg["msgid"].toString() != m_helloId)
+        return false;
+
+    m_helloId.clear();
+
+    /* the server speaks the protocol it chose from its answer on, while
+     * the frames sent since the timeout are legacy ones; rather than guess
+     * which frames either side misread, start over, in the legacy protocol
+     */
+    if (!m_negotiationTimer.isActive())
+    {
+        QXfsLog::warning("negotiate/" + objectName(),
+                         QString("%1 - answer to hello after the timeout, "
+                                 "reconnecting")
+                         .arg(objectName()),
+                         {{"device", objectName()}});
+        m_io->close();
+        return true;
+    }
+
+    const QString &hResult = msg["hResult"].toString();
+
+    if (hResult != "WFS_SUCCESS")
+    {
+        /* typically WFS_ERR_UNSUPP_COMMAND from a legacy server */
+        m_legacyPeer = true;
+        return true;
+    }
+
+    const QVariantMap &features = msg["features"].toMap();
+    const QString &byteOrder = features["byteOrder"].toString();
+    const QString &framing = features["framing"].toString();
+    const QString &compression = features["compression"].toString();
+    const QString &idFormat = features["idFormat"].toString();
+
+    if (features["codec"].toString() != "qdatastream" ||
+        (byteOrder != "big" && byteOrder != "little") ||
+        (framing != "legacy" && framing != "length") ||
+        (compression != "none" &&
+         (compression != "zlib" || framing != "length")) ||
+        (idFormat != "uuid" && idFormat != "counter") ||
+        features["multiplexing"].toBool())
+    {
+        QXfsLog::warning("negotiate/" + objectName(),
+                         QString("%1 - server chose unsupported protocol "
+                                 "features, using the legacy protocol")
+                         .arg(objectName()),
+                         {{"device", objectName()}, {"features", features}});
+        m_legacyPeer = true;
+        return true;
+    }
+
+    m_byteOrder = byteOrder == "little" ? QDataStream::LittleEndian
+                                        : QDataStream::BigEndian;
+    m_framing = framing == "length" ? QXfsStream::LengthPrefixedFraming
+                                    : QXfsStream::LegacyFraming;
+    m_compression = compression == "zlib";
+    m_counterIds = idFormat == "counter";
+    m_legacyPeer = false;
+
+    m_features = features;
+    m_features["negotiated"] = true;
+    m_features["version"] = msg["version"].toInt();
+    m_features["multiplexing"] = false;
+    m_features["idempotency"] = features["idempotency"].toBool();
+    m_features["payloadCache"] = features["payloadCache"].toBool();
+    m_features["timing"] = false;
+
+    /* the server's cache may survive a reconnection, but not a server
+     * that stopped caching
+     */
+    if (!m_features["payloadCache"].toBool())
+        m_cachedPayloads.clear();
+
+    /* the server's clock when answering is taken for the middle of the
+     * round trip, as good a sync as a single exchange allows
+     */
+    if (features["timing"].toBool() && msg.contains("serverTime"))
+    {
+        const qint64 arrived = QXfsDeviceStatistics::now();
+
+        m_clockOffset = msg["serverTime"].toLongLong() -
+                        (m_helloSent + arrived) / 2;
+        m_clockError = (arrived - m_helloSent) / 2;
+        m_serverTiming = true;
+
+        m_features["timing"] = true;
+        m_features["clockOffsetNs"] = m_clockOffset;
+        m_features["clockErrorNs"] = m_clockError;
+    }
+
+    return true;
+}
+
+void
+QXfsConnection::negotiated()
+{
+    QList<QVariantMap> held;
+
+    m_negotiationTimer.stop();
+    held.swap(m_held);
+
+    foreach (const QVariantMap &frame, held)
+        write(frame);
+
+    if (m_recoveryDue)
+    {
+        m_recoveryDue = false;
+        recover();
+    }
+}
+
+QVariantMap
+QXfsConnection::timing(const QVariantMap &fields, qint64 issued)
+{
+    static const char *names[] =
+    {
+        "uplinkNs", "queueNs", "deviceNs", "downlinkNs"
+    };
+
+    if (!fields.contains("received") || !fields.contains("started") ||
+        !fields.contains("finished"))
+    {
+        return fields;
+    }
+
+    /* server clock readings, moved onto ours */
+    const qint64 received = fields["received"].toLongLong() - m_clockOffset;
+    const qint64 started = fields["started"].toLongLong() - m_clockOffset;
+    const qint64 finished = fields["finished"].toLongLong() - m_clockOffset;
+    const qint64 phases[QXfsStatistics::PhaseCount] =
+    {
+        received - issued,
+        started - received,
+        finished - started,
+        QXfsDeviceStatistics::now() - finished
+    };
+    QVariantMap rv = fields;
+
+    for (int i = 0; i < QXfsStatistics::PhaseCount; i++)
+    {
+        m_statistics->recordPhase(QXfsStatistics::Phase(i), phases[i]);
+        rv.insert(names[i], phases[i]);
+    }
+
+    rv.insert("clockErrorNs", m_clockError);
+
+    return rv;
+}
+
+QString
+QXfsConnection::createMsgId()
+{
+    if (m_counterIds)
+        return QString::number(++m_lastId);
+
+    return QUuid::createUuid().toString();
+}
+
+QString
+QXfsConnection::createIdempotencyKey() const
+{
+    if (!m_features["idempotency"].toBool())
+        return QString();
+
+    return QUuid::createUuid().toString();
+}
+
+bool
+QXfsConnection::cachePayloads(QVariantMap &frame)
+{
+    QVariantMap lpCmdData;
+    QVariantMap cacheKeys;
+    QVariantMap cachedFields;
+    QVariantMap::const_iterator it;
+
+    if (!m_features["payloadCache"].toBool() ||
+        frame["lpCmdData"].type() != QVariant::Map)
+    {
+        return false;
+    }
+
+    lpCmdData = frame["lpCmdData"].toMap();
+
+    for (it = lpCmdData.cbegin(); it != lpCmdData.cend(); it++)
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha256);
+        const QVariant &value = it.value();
+
+        /* the type is hashed too, the server hands back what it got */
+        if (value.type() == QVariant::ByteArray &&
+            value.toByteArray().size() >= cachedPayloadThreshold)
+        {
+            hash.addData("b", 1);
+            hash.addData(value.toByteArray());
+        }
+        else if (value.type() == QVariant::String &&
+                 value.toString().size() >= cachedPayloadThreshold)
+        {
+            const QString &s = value.toString();
+
+            hash.addData("s", 1);
+            hash.addData(reinterpret_cast<const char *>(s.constData()),
+                         s.size() * int(sizeof(QChar)));
+        }
+        else
+            continue;
+
+        const QString &key = hash.result().toHex();
+
+        if (m_cachedPayloads.contains(key))
+        {
+            cachedFields.insert(it.key(), key);
+            m_statistics->payloadBytesSaved.fetch_add(
+                        value.type() == QVariant::String
+                        ? value.toString().size() * sizeof(QChar)
+                        : value.toByteArray().size(),
+                        std::memory_order_relaxed);
+            continue;
+        }
+
+        if (m_cachedPayloads.size() >= maxCachedPayloads)
+            m_cachedPayloads.clear();
+
+        /* believed cached from now on, a miss corrects it */
+        m_cachedPayloads.insert(key);
+        cacheKeys.insert(it.key(), key);
+    }
+
+    if (!cacheKeys.isEmpty())
+        frame.insert("cacheKeys", cacheKeys);
+
+    if (cachedFields.isEmpty())
+        return false;
+
+    for (it = cachedFields.cbegin(); it != cachedFields.cend(); it++)
+        lpCmdData.remove(it.key());
+
+    m_statistics->payloadCacheHits.fetch_add(cachedFields.size(),
+                                             std::memory_order_relaxed);
+    frame.insert("lpCmdData", lpCmdData);
+    frame.insert("cachedFields", cachedFields);
+
+    return true;
+}
+
+bool
+QXfsConnection::payloadsMissed(const QVariantMap &msg)
+{
+    if (msg["hResult"].toString() != "WFS_ERR_CACHE_MISS")
+        return false;
+
+    foreach (const QVariant &key, msg["missing"].toList())
+        m_cachedPayloads.remove(key.toString());
+
+    m_statistics->payloadCacheMisses.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+void
+QXfsConnection::lost()
+{
+    /* a negotiation in progress died with the connection, and with it
+     * the frames held back and a recovery waiting for it
+     */
+    const bool waiting = m_recoveryDue;
+
+    m_negotiationTimer.stop();
+    m_held.clear();
+    m_recoveryDue = false;
+
+    QMutexLocker lock(&m_mutex);
+    QHash<QString, int>::iterator it = m_pending.begin();
+    QList<QVariantMap> failed;
+
+    /* requests set aside but no lookup sent yet: recover() is queued */
+    bool scheduled = !waiting && !m_recovering.isEmpty() &&
+                     m_recoveryId.isEmpty();
+
+    while (it != m_pending.end())
+    {
+        const Pending &entry = m_slots.at(it.value());
+
+        if (!entry.stream)
+        {
+            /* a lookup that died with the connection, recover() again */
+            m_recoveryId.clear();
+            release(it++);
+            continue;
+        }
+
+        if (!entry.retry.isEmpty())
+            m_recovering.insert(it.key());
+        else if (!m_recovering.contains(it.key()))
+        {
+            failed.append({{"hResult", "WFS_ERR_CONNECTION_LOST"},
+                           {"msgid", it.key()},
+                           {"dwCommandCode", entry.dwCommand}});
+        }
+
+        ++it;
+    }
+
+    lock.unlock();
+
+    /* whatever the transport, nothing else would ever complete them */
+    foreach (const QVariantMap &msg, failed)
+        dispatch(msg);
+
+    if (scheduled || m_recovering.isEmpty())
+        return;
+
+    QMetaObject::invokeMethod(this, [this]
+    {
+        recover();
+    }, Qt::QueuedConnection);
+}
+
+void
+QXfsConnection::recover()
+{
+    QVariantList keys;
+
+    if (!open(reconnectTimeout))
+    {
+        if (m_reconnectAttempts == maxReconnectRetries)
+        {
+            m_reconnectAttempts = 0;
+            abandon();
+            return;
+        }
+
+        /* lost() schedules no other recover() meanwhile, as requests are
+         * set aside and no lookup is outstanding
+         */
+        QXfsTimer::singleShot(reconnectBackoff << m_reconnectAttempts++,
+                              this, [this]
+        {
+            recover();
+        });
+        return;
+    }
+
+    m_reconnectAttempts = 0;
+
+    /* whether the server can be asked is only known once negotiated */
+    if (m_negotiationTimer.isActive())
+    {
+        m_recoveryDue = true;
+        return;
+    }
+
+    if (!m_features["idempotency"].toBool())
+    {
+        abandon();
+        return;
+    }
+
+    {
+        QMutexLocker lock(&m_mutex);
+
+        foreach (const QString &msgid, m_recovering)
+        {
+            QHash<QString, int>::const_iterator it = m_pending.constFind(msgid);
+
+            if (it != m_pending.constEnd())
+                keys.append(m_slots.at(it.value()).retry["idempotencyKey"]);
+        }
+    }
+
+    if (keys.isEmpty())
+    {
+        m_recovering.clear();
+        return;
+    }
+
+    const QString msgid = createMsgId();
+
+    m_recoveryId = msgid;
+
+    /* no proxy issued the lookup, its handler runs regardless */
+    addPending(msgid, nullptr, QString(), [this, msgid](QVariantMap msg)
+    {
+        removePending(msgid);
+
+        if (m_recoveryId == msgid)
+        {
+            m_recoveryId.clear();
+            resolve(msg);
+        }
+    });
+
+    write({{"function", "WFSQueryCompletion"},
+           {"msgid", msgid},
+           {"lpCmdData", QVariantMap {{"keys", keys}}}});
+
+    QXfsTimer::singleShot(recoveryTimeout, this, [this, msgid]
+    {
+        if (m_recoveryId != msgid)
+            return;
+
+        QXfsLog::warning("recover/" + objectName(),
+                         QString("%1 - no answer to completion lookup")
+                         .arg(objectName()),
+                         {{"device", objectName()}});
+        m_recoveryId.clear();
+        removePending(msgid);
+        abandon();
+    });
+}
+
+void
+QXfsConnection::resolve(const QVariantMap &reply)
+{
+    const QVariantMap &results = reply["lpBuffer"].toMap();
+    QList<QVariantMap> retries;
+    QSet<QString> recovering;
+
+    if (reply["hResult"].toString() != "WFS_SUCCESS")
+    {
+        abandon();
+        return;
+    }
+
+    recovering.swap(m_recovering);
+
+    foreach (const QString &msgid, recovering)
+    {
+        QVariantMap retry;
+
+        {
+            QMutexLocker lock(&m_mutex);
+            QHash<QString, int>::const_iterator it = m_pending.constFind(msgid);
+
+            /* proxy gone meanwhile */
+            if (it == m_pending.constEnd())
+                continue;
+
+            retry = m_slots.at(it.value()).retry;
+        }
+
+        const QVariantMap &result =
+                results[retry["idempotencyKey"].toString()].toMap();
+        const QString &state = result["state"].toString();
+
+        if (state == "completed" && result.contains("frame"))
+        {
+            /* the completion lost with the connection, as kept by the
+             * server
+             */
+            QVariantMap frame = result["frame"].toMap();
+
+            frame["msgid"] = msgid;
+            enqueue(frame);
+        }
+        else if (state == "running")
+        {
+            /* the server delivers the rest on the new connection */
+        }
+        else if (state == "unknown")
+        {
+            /* never arrived, safe to send again under the same key */
+            retries.append(retry);
+        }
+        else
+        {
+            enqueue({{"hResult", "WFS_ERR_CONNECTION_LOST"},
+                     {"msgid", msgid},
+                     {"dwCommandCode", retry["dwCommand"]}});
+        }
+    }
+
+    foreach (const QVariantMap &retry, retries)
+        write(retry);
+}
+
+void
+QXfsConnection::abandon()
+{
+    QSet<QString> recovering;
+
+    recovering.swap(m_recovering);
+
+    foreach (const QString &msgid, recovering)
+    {
+        QMutexLocker lock(&m_mutex);
+        QHash<QString, int>::const_iterator it = m_pending.constFind(msgid);
+
+        if (it == m_pending.constEnd())
+            continue;
+
+        QVariantMap msg
+        {
+            {"hResult", "WFS_ERR_CONNECTION_LOST"},
+            {"msgid", msgid},
+            {"dwCommandCode", m_slots.at(it.value()).dwCommand}
+        };
+
+        lock.unlock();
+        enqueue(msg);
+    }
+}
+
+QSharedPointer<QXfsConnection>
+QXfsConnection::shared(const QString &key,
+                       const std::function<QXfsConnection *()> &create)
+{
+    QMutexLocker lock(connectionMutex);
+    QXfsConnectionMap::iterator it = connections->find(key);
+
+    while (it != connections->end() && it.key() == key)
+    {
+        QSharedPointer<QXfsConnection> connection = it.value().toStrongRef();
+
+        if (!connection)
+            it = connections->erase(it);
+        else if (connection->thread() == QThread::currentThread())
+            return connection;
+        else
+            ++it;
+    }
+
+    QSharedPointer<QXfsConnection> connection(create(),
+                                              &QObject::deleteLater);
+
+    connections->insert(key, connection);
+
+    return connection;
+}
+
+void
+QXfsConnection::attach(QXfsStream *stream)
+{
+    QMutexLocker lock(&m_mutex);
+
+    m_streams.append(stream);
+}
+
+/**
+ * @brief True if @p msg is the last frame of its request; requests without
+ *        a command (cancels) are answered by a single frame.
+ */
+static bool
+lastFrame(const QVariantMap &msg, bool completes)
+{
+    const QString &message = msg["message"].toString();
+
+    if (!completes)
+        return true;
+
+    if (message.isEmpty())
+        return msg["hResult"] != "WFS_SUCCESS";
+
+    return message != "WFS_EXECUTE_EVENT";
+}
+
+void
+QXfsConnection::detach(QXfsStream *stream)
+{
+    QHash<QString, int>::iterator it;
+    int count;
+
+    removeDirectHandler(stream, -1);
+
+    QMutexLocker lock(&m_mutex);
+
+    m_streams.removeOne(stream);
+    m_idle.remove(stream);
+    count = m_streamPending.take(stream);
+
+    if (!count)
+        return;
+
+    /* the replies still to come would otherwise be broadcast to the other
+     * proxies as unsolicited messages
+     */
+    for (it = m_pending.begin(); it != m_pending.end(); ++it)
+    {
+        Pending &entry = m_slots[it.value()];
+        const QString msgid = it.key();
+        const bool completes = !entry.dwCommand.isEmpty();
+        QList<Command>::iterator cmd;
+
+        if (entry.stream != stream)
+            continue;
+
+        for (cmd = m_commands.begin(); cmd != m_commands.end(); ++cmd)
+        {
+            if (cmd->msgid == msgid)
+            {
+                m_commands.erase(cmd);
+                break;
+            }
+        }
+
+        entry.stream = nullptr;
+        entry.retry.clear();
+        entry.handler = [this, msgid, completes](const QVariantMap &msg)
+        {
+            if (lastFrame(msg, completes))
+                removePending(msgid);
+        };
+    }
+
+    m_streamPending[nullptr] += count;
+}
+
+void
+QXfsConnection::cancel(const QString &requestId)
+{
+    const QString msgid = createMsgId();
+
+    addPending(msgid, nullptr, QString(), [this, msgid](const QVariantMap &)
+    {
+        removePending(msgid);
+    });
+
+    write({{"function", "WFSCancel"},
+           {"msgid", msgid},
+           {"RequestID", requestId}});
+}
+
+QList<QXfsStream *>
+QXfsConnection::streams() const
+{
+    QMutexLocker lock(&m_mutex);
+
+    return m_streams;
+}
+
+bool
+QXfsConnection::migrate(QThread *thread)
+{
+    Q_ASSERT(this->thread() == QThread::currentThread());
+
+    const QList<QXfsStream *> &proxies = streams();
+
+    foreach (QXfsStream *stream, proxies)
+    {
+        if (stream->parent() || stream->thread() != this->thread())
+            return false;
+    }
+
+    /* a transport handed in by the application moves along, unless it is
+     * owned by some other object
+     */
+    if (m_io && m_io->parent() != this)
+    {
+        if (m_io->parent() || m_io->thread() != this->thread())
+            return false;
+
+        m_io->moveToThread(thread);
+    }
+
+    m_migrating = true;
+
+    foreach (QXfsStream *stream, proxies)
+        stream->moveToThread(thread);
+
+    m_migrating = false;
+
+    /* moves the socket and timers (children) along with the queued
+     * dispatch events posted to this connection
+     */
+    moveToThread(thread);
+
+    return true;
+}
+
+void
+QXfsConnection::write(const QVariantMap &frame)
+{
+    QXfsAllocationScope scope(m_statistics.data(),
+                              QXfsStatistics::SendAllocations);
+    Q_ASSERT(m_io->thread() == QThread::currentThread());
+
+    /* written in the agreed protocol once the hello is answered */
+    if (m_negotiationTimer.isActive())
+    {
+        m_held.append(frame);
+        return;
+    }
+
+    QDataStream ds(m_io);
+
+    ds.setByteOrder(m_byteOrder);
+
+    if (m_framing == QXfsStream::LengthPrefixedFraming)
+    {
+        QByteArray buf;
+        QDataStream bs(&buf, QIODevice::WriteOnly);
+
+        bs.setByteOrder(m_byteOrder);
+        bs << frame;
+
+        if (m_compression)
+            buf = qCompress(buf);
+
+        ds << quint32(buf.size());
+        ds.writeRawData(buf.constData(), buf.size());
+    }
+    else
+        ds << frame;
+
+    m_statistics->framesOut.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+QXfsConnection::setFraming(QXfsStream::Framing framing)
+{
+    m_configuredFraming = framing;
+
+    if (!m_features["negotiated"].toBool())
+    {
+        m_framing = framing;
+        m_features = legacyFeatures();
+    }
+}
+
+void
+QXfsConnection::addPending(const QString &msgid, QXfsStream *stream,
+                           const QString &dwCommand, const Handler &handler,
+                           const QVariantMap &retry, bool execute)
+{
+    QMutexLocker lock(&m_mutex);
+    const qint64 issued = QXfsDeviceStatistics::now();
+    int slot;
+
+    if (m_freeSlots.isEmpty())
+    {
+        slot = m_slots.size();
+        m_slots.append({stream, dwCommand, handler, issued, retry, execute});
+    }
+    else
+    {
+        slot = m_freeSlots.takeLast();
+        m_slots[slot] = {stream, dwCommand, handler, issued, retry,
+                         execute};
+    }
+
+    m_pending.insert(msgid, slot);
+    m_streamPending[stream]++;
+    m_statistics->inFlight.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+QXfsConnection::removePending(const QString &msgid)
+{
+    QMutexLocker lock(&m_mutex);
+    QHash<QString, int>::iterator it = m_pending.find(msgid);
+
+    if (it != m_pending.end())
+    {
+        m_statistics->recordLatency(QXfsDeviceStatistics::now() -
+                                    m_slots[it.value()].issued);
+        release(it);
+    }
+}
+
+void
+QXfsConnection::release(QHash<QString, int>::iterator it)
+{
+    Pending &entry = m_slots[it.value()];
+    QHash<const QXfsStream *, int>::iterator count =
+            m_streamPending.find(entry.stream);
+
+    if (count != m_streamPending.end() && --count.value() == 0)
+    {
+        m_streamPending.erase(count);
+
+        if (m_idle.contains(entry.stream))
+            notifyIdle(entry.stream);
+    }
+
+    /* drop the captured request state now, the slot itself is recycled */
+    entry.stream = nullptr;
+    entry.dwCommand.clear();
+    entry.handler = nullptr;
+    entry.retry.clear();
+
+    m_freeSlots.append(it.value());
+    m_pending.erase(it);
+    m_statistics->inFlight.fetch_sub(1, std::memory_order_relaxed);
+}
+
+QMap<QString, QString>
+QXfsConnection::pending(const QXfsStream *stream, bool executes) const
+{
+    QMutexLocker lock(&m_mutex);
+    QMap<QString, QString> rv;
+    QHash<QString, int>::const_iterator it;
+
+    if (!m_streamPending.contains(stream))
+        return rv;
+
+    for (it = m_pending.cbegin(); it != m_pending.cend(); it++)
+    {
+        const Pending &entry = m_slots.at(it.value());
+
+        if (entry.stream == stream && (entry.execute || !executes))
+            rv.insert(it.key(), entry.dwCommand);
+    }
+
+    return rv;
+}
+
+void
+QXfsConnection::whenIdle(const QXfsStream *stream,
+                         const std::function<void()> &idle)
+{
+    QMutexLocker lock(&m_mutex);
+
+    if (!idle)
+    {
+        m_idle.remove(stream);
+        return;
+    }
+
+    m_idle.insert(stream, idle);
+
+    if (!m_streamPending.contains(stream))
+        notifyIdle(stream);
+}
+
+void
+QXfsConnection::notifyIdle(const QXfsStream *stream)
+{
+    /* never called back under the mutex */
+    QMetaObject::invokeMethod(this, [this, stream]
+    {
+        std::function<void()> idle;
+
+        {
+            QMutexLocker lock(&m_mutex);
+
+            /* busy again, or withdrawn meanwhile */
+            if (m_streamPending.contains(stream))
+                return;
+
+            idle = m_idle.take(stream);
+        }
+
+        if (idle)
+            idle();
+    }, Qt::QueuedConnection);
+}
+
+void
+QXfsConnection::readyRead()
+{
+    if (m_framing == QXfsStream::LengthPrefixedFraming)
+    {
+        readFrames();
+        return;
+    }
+
+    QXfsAllocationScope scope(m_statistics.data(),
+                              QXfsStatistics::DecodeAllocations);
+
+    for (;;)
+    {
+        QVariantMap msg;
+
+        {
+            QXfsStageTimer timer(m_statistics.data(),
+                                 QXfsStatistics::DecodeStage);
+            QDataStream ds(m_io);
+
+            ds.setByteOrder(m_byteOrder);
+            ds.startTransaction();
+            ds >> msg;
+
+            if (!ds.commitTransaction())
+            {
+                timer.cancel();
+                return;
+            }
+        }
+
+        /* whatever follows the hello's answer is in the agreed protocol */
+        if (accept(msg))
+        {
+            negotiated();
+
+            if (m_io->isOpen())
+                readyRead();
+
+            return;
+        }
+
+        enqueue(msg);
+    }
+}
+
+void
+QXfsConnection::readFrames()
+{
+    QXfsAllocationScope scope(m_statistics.data(),
+                              QXfsStatistics::DecodeAllocations);
+
+    for (;;)
+    {
+        if (m_io->bytesAvailable() < qint64(sizeof(quint32)))
+            return;
+
+        const QByteArray &prefix = m_io->peek(sizeof(quint32));
+        quint32 size = m_byteOrder == QDataStream::BigEndian
+                ? qFromBigEndian<quint32>(prefix.constData())
+                : qFromLittleEndian<quint32>(prefix.constData());
+
+        /* waiting for the rest of such a frame would stall the connection
+         * while the buffer grows; the stream is lost past this point
+         */
+        if (size > maxFrameSize)
+        {
+            QXfsLog::warning("frame/" + objectName(),
+                             QString("%1 - %2 bytes frame exceeds the "
+                                     "maximum, dropping the connection")
+                             .arg(objectName()).arg(size),
+                             {{"device", objectName()}, {"size", size}});
+            m_io->close();
+            return;
+        }
+
+        if (m_io->bytesAvailable() < qint64(sizeof(quint32)) + size)
+            return;
+
+        m_io->read(sizeof(quint32));
+
+        QByteArray frame = m_io->read(size);
+        quint64 seq = m_decodeSeq++;
+
+        /* the hello's answer must be seen before cutting the next frame */
+        if (m_parallelDecoding && m_helloId.isEmpty() &&
+            frame.size() >= parallelDecodeThreshold)
+        {
+            decodePool->start(new QXfsDecodeTask(m_decodeQueue, seq, frame,
+                                                 m_byteOrder, m_compression));
+            continue;
+        }
+
+        QVariantMap msg;
+
+        {
+            QXfsStageTimer timer(m_statistics.data(),
+                                 QXfsStatistics::DecodeStage);
+
+            msg = QXfsDecodeTask::decode(frame, m_byteOrder, m_compression);
+        }
+
+        /* consumed like a corrupt frame, keeping the sequence intact */
+        bool renegotiated = accept(msg);
+
+        if (renegotiated)
+        {
+            msg.clear();
+            negotiated();
+        }
+
+        /* nothing decoding off-thread, skip the reorder queue */
+        if (seq == m_dispatchSeq)
+        {
+            m_dispatchSeq++;
+
+            if (!msg.isEmpty())
+                enqueue(msg);
+        }
+        else
+        {
+            {
+                QMutexLocker lock(&m_decodeQueue->mutex);
+
+                m_decodeQueue->decoded.insert(seq, msg);
+            }
+
+            flushDecoded();
+        }
+
+        /* whatever follows the hello's answer is in the agreed protocol */
+        if (renegotiated)
+        {
+            if (m_io->isOpen())
+                readyRead();
+
+            return;
+        }
+    }
+}
+
+void
+QXfsConnection::flushDecoded()
+{
+    QList<QVariantMap> ready;
+
+    {
+        QMutexLocker lock(&m_decodeQueue->mutex);
+        QMap<quint64, QVariantMap> &decoded = m_decodeQueue->decoded;
+
+        m_decodeQueue->flushScheduled = false;
+
+        while (!decoded.isEmpty() && decoded.firstKey() == m_dispatchSeq)
+        {
+            ready.append(decoded.take(m_dispatchSeq));
+            m_dispatchSeq++;
+        }
+    }
+
+    foreach (const QVariantMap &msg, ready)
+    {
+        if (!msg.isEmpty())
+            enqueue(msg);
+    }
+}
+
+QXfsConnection::Lane
+QXfsConnection::lane(const QVariantMap &msg)
+{
+    if (!msg.contains("message"))
+        return CompletionLane;
+
+    const QString &message = msg["message"].toString();
+
+    /* system events are attributed to the command running when they are
+     * dispatched, so acks and completions must not overtake them
+     */
+    if (message == "WFS_EXECUTE_COMPLETE" ||
+        message == "WFS_GETINFO_COMPLETE" ||
+        message == "WFS_SYSTEM_EVENT")
+    {
+        return CompletionLane;
+    }
+    else if (message == "WFS_EXECUTE_EVENT")
+        return ExecuteEventLane;
+
+    return EventLane;
+}
+
+int
+QXfsConnection::addDirectHandler(const QXfsStream *stream,
+                                 const QString &eventId,
+                                 const QXfsStream::DirectHandler &handler)
+{
+    QMutexLocker lock(&m_mutex);
+    QList<Direct> direct = m_direct.load();
+    const int id = ++m_lastDirectId;
+
+    direct.append({id, stream, eventId, handler});
+    m_direct.store(direct);
+    m_directCount.store(direct.size(), std::memory_order_release);
+
+    return id;
+}
+
+void
+QXfsConnection::removeDirectHandler(const QXfsStream *stream, int id)
+{
+    QMutexLocker lock(&m_mutex);
+    QList<Direct> direct = m_direct.load();
+    QList<Direct>::iterator it = direct.begin();
+
+    if (direct.isEmpty())
+        return;
+
+    while (it != direct.end())
+    {
+        if (it->stream == stream && (id == -1 || it->id == id))
+            it = direct.erase(it);
+        else
+            ++it;
+    }
+
+    m_direct.store(direct);
+    m_directCount.store(direct.size(), std::memory_order_release);
+}
+
+bool
+QXfsConnection::dispatchDirect(const QVariantMap &msg)
+{
+    const QString &message = msg["message"].toString();
+    bool consumed = false;
+
+    if (message != "WFS_EXECUTE_EVENT" && message != "WFS_SERVICE_EVENT" &&
+        message != "WFS_USER_EVENT" && message != "WFS_SYSTEM_EVENT")
+    {
+        return false;
+    }
+
+    const QString &eventId = QXfsStream::eventId(msg);
+
+    foreach (const Direct &entry, m_direct.load())
+    {
+        if (entry.eventId == eventId)
+            consumed = entry.handler(msg) || consumed;
+    }
+
+    return consumed;
+}
+
+void
+QXfsConnection::enqueue(const QVariantMap &msg)
+{
+    QXfsAllocationScope scope(m_statistics.data(),
+                              QXfsStatistics::DispatchAllocations);
+
+    /* latency critical events skip the queue and the event loop pass */
+    if (m_directCount.load(std::memory_order_acquire) &&
+        dispatchDirect(msg))
+    {
+        m_statistics->framesIn.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Frame frame {msg["msgid"].toString(), msg,
+                 QXfsDeviceStatistics::timing() ? QXfsDeviceStatistics::ticks()
+                                                : 0};
+    int l = lane(msg);
+
+    if (!frame.msgid.isEmpty())
+    {
+        QueuedId &queued = m_queuedIds[frame.msgid];
+
+        if (queued.count && queued.lane > l)
+            l = queued.lane;
+
+        queued.lane = l;
+        queued.count++;
+    }
+
+    m_lanes[l].enqueue(frame);
+    m_statistics->framesIn.fetch_add(1, std::memory_order_relaxed);
+    m_statistics->queueDepth.fetch_add(1, std::memory_order_relaxed);
+
+    /* delay signal emission until we re-enter the event loop, otherwise
+     * we may deadlock if someone calls a blocking function, like getInfo()
+     */
+    if (!m_dispatchScheduled)
+    {
+        m_dispatchScheduled = true;
+        QMetaObject::invokeMethod(this, [this]
+        {
+            dispatchNext();
+        }, Qt::QueuedConnection);
+    }
+}
+
+void
+QXfsConnection::dispatchNext()
+{
+    QXfsAllocationScope scope(m_statistics.data(),
+                              QXfsStatistics::DispatchAllocations);
+    Frame frame;
+    bool found = false;
+    bool more = false;
+
+    m_dispatchScheduled = false;
+
+    for (int l = CompletionLane; l < LaneCount; l++)
+    {
+        if (m_lanes[l].isEmpty())
+            continue;
+
+        if (!found)
+        {
+            frame = m_lanes[l].dequeue();
+            found = true;
+        }
+
+        more = more || !m_lanes[l].isEmpty();
+    }
+
+    if (!frame.msgid.isEmpty())
+    {
+        QHash<QString, QueuedId>::iterator it = m_queuedIds.find(frame.msgid);
+
+        if (it != m_queuedIds.end() && --it->count == 0)
+            m_queuedIds.erase(it);
+    }
+
+    /* one frame per event loop pass, as handlers may block in a nested
+     * event loop waiting for a frame queued behind this one
+     */
+    if (more)
+    {
+        m_dispatchScheduled = true;
+        QMetaObject::invokeMethod(this, [this]
+        {
+            dispatchNext();
+        }, Qt::QueuedConnection);
+    }
+
+    if (!found)
+        return;
+
+    m_statistics->queueDepth.fetch_sub(1, std::memory_order_relaxed);
+
+    if (frame.queued && QXfsDeviceStatistics::timing())
+    {
+        m_statistics->recordStage(QXfsStatistics::QueueStage,
+                                  QXfsDeviceStatistics::ticks() - frame.queued);
+    }
+
+    dispatch(frame.msg);
+}
+
+void
+QXfsConnection::dispatch(const QVariantMap &msg)
+{
+    QList<QPointer<QXfsStream>> targets;
+    Handler handler;
+    qint64 issued = 0;
+
+    {
+        QXfsStageTimer timer(m_statistics.data(),
+                             QXfsStatistics::DispatchStage);
+        QMutexLocker lock(&m_mutex);
+        QHash<QString, int>::const_iterator it =
+                m_pending.constFind(msg["msgid"].toString());
+
+        if (it != m_pending.constEnd())
+        {
+            const Pending &entry = m_slots.at(it.value());
+
+            /* requests of the connection itself have no proxy */
+            if (entry.stream)
+                targets.append(entry.stream);
+
+            handler = entry.handler;
+            issued = entry.issued;
+        }
+        else
+        {
+            foreach (QXfsStream *stream, m_streams)
+                targets.append(stream);
+        }
+    }
+
+    /* replies are only copied when there are server timing fields */
+    const QVariantMap *frame = &msg;
+    QVariantMap timed;
+
+    if (issued && m_serverTiming && msg.contains("timing"))
+    {
+        timed = msg;
+        timed["timing"] = timing(msg["timing"].toMap(), issued);
+        frame = &timed;
+    }
+
+    QXfsStageTimer timer(m_statistics.data(), QXfsStatistics::HandlerStage);
+
+    /* a cache miss is the request's own business: its handler resends the
+     * payloads under the same msgid, and the proxies see the real answer
+     */
+    const bool missed = handler &&
+                        msg["hResult"].toString() == "WFS_ERR_CACHE_MISS";
+
+    foreach (const QPointer<QXfsStream> &stream, targets)
+    {
+        if (stream && !missed)
+            stream->receive(*frame);
+    }
+
+    /* the handler finalizes the request, so it runs once the message has
+     * been seen by everyone, and only while the issuing stream is alive
+     */
+    if (handler && (targets.isEmpty() || targets.first()))
+        handler(*frame);
+}
+
+QPair<QString, QVariant>
+QXfsConnection::currentCommand() const
+{
+    QMutexLocker lock(&m_mutex);
+
+    if (!m_commands.isEmpty())
+        return m_commands.first().cmd;
+
+    return {QString(), QVariant()};
+}
+
+void
+QXfsConnection::appendCommand(const QString &msgid,
+                              const QPair<QString, QVariant> &cmd)
+{
+    QMutexLocker lock(&m_mutex);
+
+    m_commands.append({msgid, cmd});
+}
+
+void
+QXfsConnection::finishCommand(const QString &msgid)
+{
+    QMutexLocker lock(&m_mutex);
+    QList<Command>::iterator it;
+
+    for (it = m_commands.begin(); it != m_commands.end(); ++it)
+    {
+        if (it->msgid == msgid)
+        {
+            m_commands.erase(it);
+            return;
+        }
+    }
+}
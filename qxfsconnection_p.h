@@ -0,0 +1,639 @@
+#ifndef QXFSCONNECTION_P_H
+#define QXFSCONNECTION_P_H
+
+#include <QDataStream>
+#include <QHash>
+#include <QIODevice>
+#include <QMutex>
+#include <QPointer>
+#include <QQueue>
+#include <QSet>
+#include <QSharedPointer>
+#include <QVariantMap>
+#include <QVector>
+
+#include <atomic>
+#include <functional>
+
+#include "qxfsclock.h"
+#include "qxfssnapshot_p.h"
+#include "qxfsstateboard.h"
+#include "qxfsstream.h"
+
+struct QXfsDecodeQueue;
+struct QXfsDeviceStatistics;
+
+/**
+ * @class QXfsConnection
+ * @brief Transport shared by all proxies of one device.
+ *
+ * @details
+ * This class encapsulates:
+ *  - The I/O device and the decoder for the inbound frame stream.
+ *  - The dispatch table correlating request ids with the proxy that
+ *    issued them and the handler finalizing the request.
+ *  - The device-wide queue of commands in progress.
+ *
+ * Frames answering a request are delivered to the issuing proxy only,
+ * everything else (service/user/system events) to every attached proxy.
+ */
+class QXfsConnection : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief Callback finalizing a request when one of its frames arrives.
+     */
+    using Handler = std::function<void(const QVariantMap &)>;
+
+    /**
+     * @brief Wraps @p io; the device is not owned by the connection.
+     */
+    explicit QXfsConnection(QIODevice *io, const QString &deviceId,
+                            QObject *parent = nullptr);
+    ~QXfsConnection();
+
+    /**
+     * @brief Returns the connection registered under @p key for the
+     *        calling thread, creating it with @p create if there is none.
+     *
+     * Connections are shared only between proxies living in the same
+     * thread, since the transport may only be used from its own thread.
+     */
+    static QSharedPointer<QXfsConnection> shared(
+            const QString &key,
+            const std::function<QXfsConnection *()> &create);
+
+    QIODevice *io() const {return m_io;}
+
+    /**
+     * @brief Traffic counters of the device, see QXfsStatistics.
+     */
+    QXfsDeviceStatistics *statistics() const {return m_statistics.data();}
+
+    /**
+     * @brief Makes sure the transport is usable, connecting if needed.
+     *
+     * A transport that was closed, e.g. a QXfsFaultDevice after an injected
+     * disconnect, is opened again. Blocks the calling thread for up to
+     * @p msecs while a socket connects.
+     *
+     * @return bool True if frames can be written; otherwise false.
+     */
+    virtual bool open(int msecs = 30000);
+
+    void attach(QXfsStream *stream);
+
+    /**
+     * @brief Detaches @p stream; its outstanding requests pass to the
+     *        connection, which swallows their remaining frames.
+     */
+    void detach(QXfsStream *stream);
+
+    /**
+     * @brief Cancels request @p requestId of a detached proxy, swallowing
+     *        the answer.
+     */
+    void cancel(const QString &requestId);
+
+    /**
+     * @brief Returns the proxies currently attached to this connection.
+     */
+    QList<QXfsStream *> streams() const;
+
+    /**
+     * @brief Moves the connection, its transport and timers, its queued
+     *        dispatch state and all attached proxies to @p thread.
+     *
+     * Must be called from the thread the connection lives in.
+     *
+     * @return bool False if some object cannot be moved.
+     */
+    bool migrate(QThread *thread);
+
+    /**
+     * @brief True while migrate() moves the attached proxies.
+     */
+    bool isMigrating() const {return m_migrating;}
+
+    /**
+     * @brief Serializes @p frame onto the transport.
+     */
+    void write(const QVariantMap &frame);
+
+    /**
+     * @brief Returns the framing in effect, which negotiation may have
+     *        changed from the configured one.
+     */
+    QXfsStream::Framing framing() const {return m_framing;}
+    void setFraming(QXfsStream::Framing framing);
+
+    /**
+     * @brief Returns the protocol features in effect, see
+     *        QXfsStream::features().
+     */
+    QVariantMap features() const {return m_features;}
+
+    /**
+     * @brief Returns the state board the device publishes into, if any,
+     *        see QXfsStream::setStateBoard().
+     */
+    QXfsStateBoard *stateBoard() const {return m_stateBoard.data();}
+    void setStateBoard(QXfsStateBoard *board) {m_stateBoard.reset(board);}
+
+    /**
+     * @brief Sets how long negotiate() waits for the server's answer, on
+     *        QXfsClock.
+     */
+    void setNegotiationTimeout(int ms) {m_negotiationTimeout = ms;}
+
+    /**
+     * @brief Returns a new request id in the negotiated id format.
+     */
+    QString createMsgId();
+
+    /**
+     * @brief Returns a new idempotency key for an execute frame, or an
+     *        empty string if the server did not agree on idempotency.
+     */
+    QString createIdempotencyKey() const;
+
+    /**
+     * @brief Replaces the large lpCmdData fields of @p frame the server
+     *        holds in its payload cache by their content hash, and asks it
+     *        to cache the others.
+     *
+     * Does nothing unless the server agreed on the payload cache.
+     *
+     * @return bool True if some field was replaced, i.e. the server may
+     *         answer with a cache miss.
+     */
+    bool cachePayloads(QVariantMap &frame);
+
+    /**
+     * @brief Forgets the payloads a cache miss answer lists as missing.
+     *
+     * @return bool True if @p msg is a cache miss.
+     */
+    bool payloadsMissed(const QVariantMap &msg);
+
+    /**
+     * @brief Decodes length-prefixed frames on the decoder thread pool.
+     *
+     * Frames are still dispatched in arrival order.
+     */
+    void setParallelDecoding(bool enable) {m_parallelDecoding = enable;}
+
+    /**
+     * @brief Registers @p handler for the frames of request @p msgid.
+     *
+     * @param retry Frame carrying an idempotency key, resent should the
+     *        server turn out not to have received it before a lost
+     *        connection; empty if the request cannot be recovered.
+     * @param execute True for WFSExecute requests, the only ones WFSCancel
+     *        applies to.
+     */
+    void addPending(const QString &msgid, QXfsStream *stream,
+                    const QString &dwCommand, const Handler &handler,
+                    const QVariantMap &retry = QVariantMap(),
+                    bool execute = false);
+
+    /**
+     * @brief Drops the dispatch table entry of request @p msgid.
+     */
+    void removePending(const QString &msgid);
+
+    /**
+     * @brief Returns the outstanding requests of @p stream, only its
+     *        executes if @p executes is true.
+     *
+     * @return QMap Request ids mapped to their command names.
+     */
+    QMap<QString, QString> pending(const QXfsStream *stream,
+                                   bool executes = false) const;
+
+    /**
+     * @brief Calls @p idle once, from the event loop, as soon as @p stream
+     *        has no outstanding requests; an empty function withdraws it.
+     */
+    void whenIdle(const QXfsStream *stream, const std::function<void()> &idle);
+
+    /**
+     * @brief Routes a frame to its proxy, or to all of them for events.
+     */
+    void dispatch(const QVariantMap &msg);
+
+    /**
+     * @brief Registers @p handler for the events @p eventId on the I/O
+     *        path, see QXfsStream::addDirectHandler(); thread-safe.
+     *
+     * @return int Registration id.
+     */
+    int addDirectHandler(const QXfsStream *stream, const QString &eventId,
+                         const QXfsStream::DirectHandler &handler);
+
+    /**
+     * @brief Drops registration @p id, or all of @p stream with id -1.
+     */
+    void removeDirectHandler(const QXfsStream *stream, int id);
+
+    /**
+     * @brief Returns the command currently at the head of the queue.
+     */
+    QPair<QString, QVariant> currentCommand() const;
+
+    /**
+     * @brief Appends acknowledged execute @p msgid to the device-wide
+     *        command queue.
+     */
+    void appendCommand(const QString &msgid,
+                       const QPair<QString, QVariant> &cmd);
+
+    /**
+     * @brief Removes request @p msgid from the queue, if it is there.
+     */
+    void finishCommand(const QString &msgid);
+
+signals:
+    /**
+     * @brief Emitted when the transport loses its peer.
+     */
+    void disconnected();
+
+protected:
+    explicit QXfsConnection(const QString &deviceId,
+                            QObject *parent = nullptr);
+
+    /**
+     * @brief Binds the transport once a subclass has created it.
+     */
+    void setIo(QIODevice *io);
+
+    /**
+     * @brief Negotiates the protocol with the server after the transport
+     *        (re)connected; does nothing otherwise.
+     *
+     * Sends a hello frame in the configured framing offering the supported
+     * features and returns. Frames written until the answer arrives are
+     * held back and written in the agreed protocol. A server that rejects
+     * the hello or does not answer in time is taken for a legacy one and
+     * not asked again; should its answer come late, the transport is
+     * closed, as the two sides no longer agree on the protocol.
+     */
+    void negotiate();
+
+private slots:
+    /**
+     * @brief Slot invoked when the transport has data to read.
+     *
+     * Decodes inbound frames and schedules their dispatch.
+     */
+    void readyRead();
+
+    /**
+     * @brief Slot invoked when the transport (re)connects to its peer.
+     */
+    void transportConnected();
+
+    /**
+     * @brief Slot invoked when the transport loses its peer; emits
+     *        disconnected() once per connection.
+     */
+    void transportLost();
+
+    /**
+     * @brief Slot invoked, queued, when the transport was closed; a plain
+     *        QIODevice reports nothing else.
+     */
+    void transportClosed();
+
+private:
+    friend class QXfsDecodeTask;
+
+    /**
+     * @brief Dispatch priorities of inbound frames, highest first.
+     */
+    enum Lane
+    {
+        CompletionLane,     /**< Replies, completions, cancel acks and
+                                 system events, in arrival order. */
+        ExecuteEventLane,   /**< Intermediate execute events. */
+        EventLane,          /**< Service and user events. */
+        LaneCount
+    };
+
+    /**
+     * @brief Inbound frame waiting for dispatch.
+     */
+    struct Frame
+    {
+        QString msgid;
+        QVariantMap msg;
+
+        /**
+         * @brief Stage timer clock when queued, 0 with timers off.
+         */
+        quint64 queued;
+    };
+
+    /**
+     * @brief Queued frames of one request id.
+     *
+     * Later frames of a request never go to a higher priority lane than
+     * its queued ones, which keeps per-msgid ordering.
+     */
+    struct QueuedId
+    {
+        int lane;
+        int count;
+    };
+
+    static Lane lane(const QVariantMap &msg);
+
+    /**
+     * @brief Returns the legacy protocol features, in effect until the
+     *        server agreed on others.
+     */
+    QVariantMap legacyFeatures() const;
+
+    /**
+     * @brief Applies the server's answer to the hello.
+     *
+     * @return bool False if @p msg is not the answer.
+     */
+    bool accept(const QVariantMap &msg);
+
+    /**
+     * @brief Ends the negotiation: writes the frames held back meanwhile
+     *        and resumes a recovery that waited for it.
+     */
+    void negotiated();
+
+    /**
+     * @brief Completes the server timing fields of a reply to a request
+     *        issued at @p issued with the phase durations, and counts them.
+     */
+    QVariantMap timing(const QVariantMap &fields, qint64 issued);
+
+    /**
+     * @brief Sets the recoverable requests aside when the transport is
+     *        lost and schedules recover().
+     */
+    void lost();
+
+    /**
+     * @brief Reconnects and asks the server in one batched
+     *        WFSQueryCompletion which requests set aside it completed.
+     *
+     * Each reconnection attempt blocks the connection's thread for
+     * reconnectTimeout at most; failed attempts are retried with an
+     * exponential backoff before the requests are failed.
+     */
+    void recover();
+
+    /**
+     * @brief Resolves the requests set aside from the server's answer:
+     *        delivers the completions, resends what never arrived.
+     */
+    void resolve(const QVariantMap &reply);
+
+    /**
+     * @brief Fails the requests set aside with WFS_ERR_CONNECTION_LOST.
+     */
+    void abandon();
+
+    /**
+     * @brief Cuts length-prefixed frames off the transport.
+     */
+    void readFrames();
+
+    /**
+     * @brief Queues frames decoded off-thread, in their original order.
+     */
+    void flushDecoded();
+
+    /**
+     * @brief Queues a decoded frame for deferred, prioritized dispatch.
+     */
+    void enqueue(const QVariantMap &msg);
+
+    /**
+     * @brief Hands an event to its direct handlers.
+     *
+     * @return bool True if one of them consumed it.
+     */
+    bool dispatchDirect(const QVariantMap &msg);
+
+    /**
+     * @brief Dispatches the highest priority queued frame.
+     */
+    void dispatchNext();
+
+    /**
+     * @brief Dispatch table entry of an outstanding request.
+     */
+    struct Pending
+    {
+        QXfsStream *stream;
+        QString dwCommand;
+        Handler handler;
+
+        /**
+         * @brief Time the request was issued, see
+         *        QXfsDeviceStatistics::now().
+         */
+        qint64 issued;
+
+        /**
+         * @brief Frame to resend after a lost connection, see addPending().
+         */
+        QVariantMap retry;
+
+        bool execute;
+    };
+
+    /**
+     * @brief Returns the slot of @p msgid to the pool.
+     */
+    void release(QHash<QString, int>::iterator it);
+
+    /**
+     * @brief Schedules the idle callback of @p stream; under m_mutex.
+     */
+    void notifyIdle(const QXfsStream *stream);
+
+    QIODevice *m_io;
+
+    /**
+     * @brief Protects the dispatch table, proxies and command queue.
+     */
+    mutable QMutex m_mutex;
+
+    QList<QXfsStream *> m_streams;
+
+    /**
+     * @brief Dispatch table, request ids mapped to slots of m_slots.
+     */
+    QHash<QString, int> m_pending;
+
+    /**
+     * @brief Pool of dispatch table entries, reused through m_freeSlots
+     *        so the entries keep their storage across requests.
+     *
+     * The m_pending node and the handler's std::function still allocate
+     * per command; qxfs-bench reports the count with allocation accounting.
+     */
+    QVector<Pending> m_slots;
+    QVector<int> m_freeSlots;
+
+    /**
+     * @brief Number of outstanding requests per proxy, so idle proxies
+     *        detach without scanning the dispatch table.
+     */
+    QHash<const QXfsStream *, int> m_streamPending;
+    QHash<const QXfsStream *, std::function<void()>> m_idle;
+
+    /**
+     * @brief Direct handler registration.
+     */
+    struct Direct
+    {
+        int id;
+        const QXfsStream *stream;
+        QString eventId;
+        QXfsStream::DirectHandler handler;
+    };
+
+    /**
+     * @brief Direct handlers, read by the I/O path without a lock and
+     *        changed under m_mutex; m_directCount spares the lookup while
+     *        there are none.
+     */
+    QXfsSnapshot<QList<Direct>> m_direct;
+    std::atomic<int> m_directCount;
+    int m_lastDirectId;
+
+    /**
+     * @brief Acknowledged executes, in the order the device runs them.
+     */
+    struct Command
+    {
+        QString msgid;
+        QPair<QString, QVariant> cmd;
+    };
+
+    QList<Command> m_commands;
+
+    /**
+     * @brief Deferred dispatch queues, one per Lane; owner thread only.
+     */
+    QQueue<Frame> m_lanes[LaneCount];
+    QHash<QString, QueuedId> m_queuedIds;
+    bool m_dispatchScheduled;
+
+    /**
+     * @brief Framing set by the application, used until negotiation and
+     *        with legacy servers; m_framing is the one in effect.
+     */
+    QXfsStream::Framing m_configuredFraming;
+    QXfsStream::Framing m_framing;
+
+    /**
+     * @brief Negotiated byte order, zlib compression of length-prefixed
+     *        frames and counter request ids.
+     */
+    QDataStream::ByteOrder m_byteOrder;
+    bool m_compression;
+    bool m_counterIds;
+    quint64 m_lastId;
+
+    QVariantMap m_features;
+    QScopedPointer<QXfsStateBoard> m_stateBoard;
+    int m_negotiationTimeout;
+
+    /**
+     * @brief True from a (re)connection until negotiate() ran.
+     */
+    bool m_negotiationDue;
+
+    /**
+     * @brief True once the server proved not to know the hello.
+     */
+    bool m_legacyPeer;
+
+    /**
+     * @brief Request id of the unanswered hello, if any, and when it was
+     *        sent.
+     */
+    QString m_helloId;
+    qint64 m_helloSent;
+
+    /**
+     * @brief Runs while the hello is unanswered, frames written meanwhile
+     *        are held back in m_held.
+     */
+    QXfsTimer m_negotiationTimer;
+    QList<QVariantMap> m_held;
+
+    /**
+     * @brief True if recover() waits for the negotiation to end.
+     */
+    bool m_recoveryDue;
+
+    /**
+     * @brief Reconnection attempts of recover() failed so far.
+     */
+    int m_reconnectAttempts;
+
+    /**
+     * @brief True if replies carry server timing fields; the server clock
+     *        is ahead of ours by m_clockOffset, give or take m_clockError
+     *        (half the round trip of the hello), in nanoseconds.
+     */
+    bool m_serverTiming;
+    qint64 m_clockOffset;
+    qint64 m_clockError;
+
+    /**
+     * @brief Requests set aside by lost(), and the id of the completion
+     *        lookup resolving them while it is outstanding.
+     */
+    QSet<QString> m_recovering;
+    QString m_recoveryId;
+
+    /**
+     * @brief Content hashes of the payloads the server is believed to
+     *        hold; a cache miss corrects the belief.
+     */
+    QSet<QString> m_cachedPayloads;
+
+    bool m_parallelDecoding;
+    bool m_migrating;
+
+    /**
+     * @brief True once the transport has connected, later connections
+     *        count as reconnects.
+     */
+    bool m_wasConnected;
+
+    /**
+     * @brief True while the transport is connected, as far as reported.
+     */
+    bool m_connected;
+
+    /**
+     * @brief Frames decoded off-thread, shared with the decode tasks.
+     */
+    QSharedPointer<QXfsDecodeQueue> m_decodeQueue;
+
+    /**
+     * @brief Sequence numbers of the next frame cut and dispatched.
+     */
+    quint64 m_decodeSeq;
+    quint64 m_dispatchSeq;
+
+    QSharedPointer<QXfsDeviceStatistics> m_statistics;
+};
+
+#endif // QXFSCONNECTION_P_H
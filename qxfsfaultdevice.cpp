@@ -0,0 +1,244 @@
+#include "qxfsfaultdevice.h"
+
+QXfsFaultDevice::QXfsFaultDevice(QIODevice *device, QObject *parent) :
+    QIODevice(parent),
+    m_device(device),
+    m_timer(this),
+    m_latency(0),
+    m_bandwidth(0),
+    m_fragmentSize(0),
+    m_disconnectProbability(0)
+{
+    Q_ASSERT(m_device);
+
+    m_timer.setSingleShot(true);
+
+    connect(&m_timer, SIGNAL(timeout()), SLOT(pump()));
+    connect(m_device, SIGNAL(readyRead()), SLOT(deviceReadyRead()));
+
+    if (m_device->metaObject()->indexOfSignal("disconnected()") != -1)
+        connect(m_device, SIGNAL(disconnected()), SLOT(deviceDisconnected()));
+
+    if (m_device->isOpen())
+        QIODevice::open(m_device->openMode());
+}
+
+QXfsFaultDevice::~QXfsFaultDevice()
+{
+    m_device->disconnect(this);
+}
+
+void
+QXfsFaultDevice::setLatency(int ms)
+{
+    m_latency = qMax(ms, 0);
+}
+
+void
+QXfsFaultDevice::setBandwidth(qint64 bytesPerSecond)
+{
+    m_bandwidth = qMax(bytesPerSecond, qint64(0));
+}
+
+void
+QXfsFaultDevice::setFragmentSize(int bytes)
+{
+    m_fragmentSize = qMax(bytes, 0);
+}
+
+void
+QXfsFaultDevice::setDisconnectProbability(double p)
+{
+    m_disconnectProbability = qBound(0.0, p, 1.0);
+}
+
+void
+QXfsFaultDevice::setSeed(quint32 seed)
+{
+    m_random.seed(seed);
+}
+
+qint64
+QXfsFaultDevice::bytesAvailable() const
+{
+    return m_buffer.size() + QIODevice::bytesAvailable();
+}
+
+qint64
+QXfsFaultDevice::bytesToWrite() const
+{
+    return m_outbound.bytes + m_device->bytesToWrite();
+}
+
+bool
+QXfsFaultDevice::open(OpenMode mode)
+{
+    if (!m_device->isOpen() && !m_device->open(mode))
+        return false;
+
+    return QIODevice::open(mode);
+}
+
+void
+QXfsFaultDevice::close()
+{
+    clear();
+    QIODevice::close();
+    m_device->close();
+}
+
+void
+QXfsFaultDevice::disconnectNow()
+{
+    if (!isOpen())
+        return;
+
+    close();
+
+    emit readChannelFinished();
+    emit disconnected();
+}
+
+qint64
+QXfsFaultDevice::readData(char *data, qint64 maxSize)
+{
+    qint64 size = qMin(maxSize, qint64(m_buffer.size()));
+
+    memcpy(data, m_buffer.constData(), size);
+    m_buffer.remove(0, size);
+
+    return size;
+}
+
+qint64
+QXfsFaultDevice::writeData(const char *data, qint64 size)
+{
+    enqueue(m_outbound, QByteArray(data, size));
+
+    return size;
+}
+
+void
+QXfsFaultDevice::deviceReadyRead()
+{
+    const QByteArray &data = m_device->readAll();
+
+    if (!data.isEmpty())
+        enqueue(m_inbound, data);
+}
+
+void
+QXfsFaultDevice::deviceDisconnected()
+{
+    /* after an injected fault the decorator has reported already */
+    if (!isOpen())
+        return;
+
+    clear();
+    QIODevice::close();
+
+    emit readChannelFinished();
+    emit disconnected();
+}
+
+void
+QXfsFaultDevice::enqueue(Direction &direction, const QByteArray &data)
+{
+    const qint64 now = QXfsClock::instance()->elapsed();
+    const int size = m_fragmentSize ? m_fragmentSize : data.size();
+
+    for (int i = 0; i < data.size(); i += size)
+    {
+        direction.segments.enqueue({now + m_latency, data.mid(i, size)});
+        direction.bytes += qMin(size, data.size() - i);
+    }
+
+    if (!m_timer.isActive())
+        schedule(now);
+}
+
+QByteArray
+QXfsFaultDevice::take(Direction &direction, qint64 now)
+{
+    if (direction.segments.isEmpty())
+        return QByteArray();
+
+    const Direction::Segment &head = direction.segments.head();
+
+    if (head.due > now || direction.busyUntil > now)
+        return QByteArray();
+
+    QByteArray rv = direction.segments.dequeue().data;
+
+    direction.bytes -= rv.size();
+
+    if (m_bandwidth)
+        direction.busyUntil = now + rv.size() * 1000 / m_bandwidth;
+
+    return rv;
+}
+
+void
+QXfsFaultDevice::pump()
+{
+    const qint64 now = QXfsClock::instance()->elapsed();
+
+    /* one segment per direction and pass, so every fragment reaches the
+     * reader in a readyRead() of its own
+     */
+    const QByteArray &out = take(m_outbound, now);
+
+    if (!out.isEmpty())
+    {
+        m_device->write(out);
+        emit bytesWritten(out.size());
+    }
+
+    const QByteArray &in = take(m_inbound, now);
+
+    if (!in.isEmpty())
+    {
+        m_buffer.append(in);
+        emit readyRead();
+    }
+
+    if ((!out.isEmpty() || !in.isEmpty()) &&
+        m_random.generateDouble() < m_disconnectProbability)
+    {
+        disconnectNow();
+        return;
+    }
+
+    schedule(QXfsClock::instance()->elapsed());
+}
+
+void
+QXfsFaultDevice::schedule(qint64 now)
+{
+    const Direction *directions[] = {&m_inbound, &m_outbound};
+    qint64 next = -1;
+
+    for (const Direction *direction : directions)
+    {
+        if (direction->segments.isEmpty())
+            continue;
+
+        qint64 due = qMax(direction->segments.head().due,
+                          direction->busyUntil);
+
+        if (next < 0 || due < next)
+            next = due;
+    }
+
+    if (next >= 0)
+        m_timer.start(int(qMax(next - now, qint64(0))));
+}
+
+void
+QXfsFaultDevice::clear()
+{
+    m_timer.stop();
+    m_inbound = Direction();
+    m_outbound = Direction();
+    m_buffer.clear();
+}
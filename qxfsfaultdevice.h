@@ -0,0 +1,155 @@
+#ifndef QXFSFAULTDEVICE_H
+#define QXFSFAULTDEVICE_H
+
+#include <QIODevice>
+#include <QQueue>
+#include <QRandomGenerator>
+
+#include "qxfs_global.h"
+#include "qxfsclock.h"
+
+/**
+ * @class QXfsFaultDevice
+ * @brief Transport decorator injecting network faults, for tests and
+ *        benchmarks.
+ *
+ * @details
+ * Wraps any open transport and passes its traffic through with configurable
+ * latency, a bandwidth cap, fragmentation into small segments (so readers
+ * see partial frames on readyRead()) and random disconnects. Pass it to
+ * QXfsStream in place of the transport it wraps:
+ *
+ * @code
+ * QXfsFaultDevice *faults = new QXfsFaultDevice(socket);
+ *
+ * faults->setLatency(20);
+ * faults->setFragmentSize(7);
+ * faults->setDisconnectProbability(0.001);
+ *
+ * QXfsStream *cdm = new MyStream(faults, "CDM1", "CDM");
+ * @endcode
+ *
+ * Faults are drawn from a seeded generator, so a run can be replayed, and
+ * delays run on QXfsClock, so a simulated clock skips them.
+ */
+class QXFS_EXPORT QXfsFaultDevice : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief Decorates @p device, which must outlive the decorator.
+     *
+     * The decorator opens along with @p device if it is open already.
+     */
+    explicit QXfsFaultDevice(QIODevice *device, QObject *parent = nullptr);
+    virtual ~QXfsFaultDevice();
+
+    QIODevice *device() const {return m_device;}
+
+    /**
+     * @brief Delays every segment by @p ms in either direction.
+     */
+    void setLatency(int ms);
+
+    /**
+     * @brief Caps either direction at @p bytesPerSecond; 0 is unlimited.
+     */
+    void setBandwidth(qint64 bytesPerSecond);
+
+    /**
+     * @brief Cuts traffic into segments of at most @p bytes, each
+     *        delivered in its own event loop pass; 0 keeps writes whole.
+     */
+    void setFragmentSize(int bytes);
+
+    /**
+     * @brief Drops the connection after a segment with probability @p p.
+     */
+    void setDisconnectProbability(double p);
+
+    /**
+     * @brief Reseeds the fault generator.
+     */
+    void setSeed(quint32 seed);
+
+    /**
+     * @brief Drops the connection now, discarding traffic in flight.
+     */
+    void disconnectNow();
+
+    virtual bool isSequential() const {return true;}
+    virtual qint64 bytesAvailable() const;
+    virtual qint64 bytesToWrite() const;
+
+    /**
+     * @brief Opens the decorator, reopening the wrapped device if closed,
+     *        as after disconnectNow().
+     *
+     * A QLocalSocket reconnects to its server this way, and QXfsStream
+     * reopens its transport so on the next request after a disconnect.
+     */
+    virtual bool open(OpenMode mode);
+    virtual void close();
+
+signals:
+    /**
+     * @brief Emitted when the wrapped transport or an injected fault drops
+     *        the connection.
+     */
+    void disconnected();
+
+protected:
+    virtual qint64 readData(char *data, qint64 maxSize);
+    virtual qint64 writeData(const char *data, qint64 size);
+
+private slots:
+    void deviceReadyRead();
+    void deviceDisconnected();
+    void pump();
+
+private:
+    /**
+     * @brief Traffic of one direction waiting for its delivery time.
+     */
+    struct Direction
+    {
+        struct Segment
+        {
+            qint64 due;
+            QByteArray data;
+        };
+
+        QQueue<Segment> segments;
+        qint64 bytes = 0;
+
+        /**
+         * @brief Time until which the bandwidth cap holds the direction.
+         */
+        qint64 busyUntil = 0;
+    };
+
+    void enqueue(Direction &direction, const QByteArray &data);
+    QByteArray take(Direction &direction, qint64 now);
+    void schedule(qint64 now);
+    void clear();
+
+    QIODevice *m_device;
+    Direction m_inbound;
+    Direction m_outbound;
+
+    /**
+     * @brief Inbound bytes delivered and not yet read.
+     */
+    QByteArray m_buffer;
+
+    QXfsTimer m_timer;
+    QRandomGenerator m_random;
+
+    int m_latency;
+    qint64 m_bandwidth;
+    int m_fragmentSize;
+    double m_disconnectProbability;
+};
+
+#endif // QXFSFAULTDEVICE_H
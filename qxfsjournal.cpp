@@ -0,0 +1,288 @@
+#include <QSaveFile>
+#include <QUuid>
+#include <QtEndian>
+
+#include <atomic>
+#include <cstring>
+
+#include "qxfsjournal_p.h"
+#include "qxfslog.h"
+
+/**
+ * @brief Leading bytes of a journal file.
+ */
+static const char journalMagic[8] = {'Q', 'X', 'F', 'S', 'J', 'R', 'N', '1'};
+
+/**
+ * @brief Size of a record header: type and payload size.
+ */
+static const qint64 headerSize = 4;
+
+/**
+ * @brief Size of a fresh journal file.
+ */
+static const qint64 initialCapacity = 64 * 1024;
+
+/**
+ * @brief Size up to which a full journal file is extended in place rather
+ *        than compacted.
+ */
+static const qint64 maxGrowCapacity = 4 * 1024 * 1024;
+
+static qint64
+recordSize(int payloadSize)
+{
+    return headerSize + ((payloadSize + 3) & ~3);
+}
+
+/**
+ * @brief Writes a record at @p at, committing it with its type last.
+ */
+static void
+writeRecord(uchar *at, quint16 type, const QByteArray &payload)
+{
+    memcpy(at + headerSize, payload.constData(), payload.size());
+    qToLittleEndian<quint16>(quint16(payload.size()), at + 2);
+
+    /* only the process dying midway is guarded against, and it sees its
+     * own stores in program order, so keeping the compiler from moving the
+     * type ahead is enough
+     */
+    std::atomic_signal_fence(std::memory_order_release);
+    qToLittleEndian<quint16>(type, at);
+}
+
+QXfsJournal::QXfsJournal(const QString &fileName) :
+    m_file(new QFile(fileName)),
+    m_run(QUuid::createUuid().toString().mid(1, 36)),
+    m_data(nullptr),
+    m_capacity(initialCapacity),
+    m_offset(0)
+{
+}
+
+QXfsJournal::~QXfsJournal()
+{
+    if (m_data)
+        m_file->unmap(m_data);
+}
+
+bool
+QXfsJournal::open()
+{
+    const QByteArray magic(journalMagic, sizeof(journalMagic));
+    QFile previous(m_file->fileName());
+    QHash<QString, QString>::const_iterator it;
+
+    if (previous.open(QIODevice::ReadOnly))
+    {
+        const QByteArray &data = previous.readAll();
+        const uchar *base = reinterpret_cast<const uchar *>(data.constData());
+        qint64 offset = magic.size();
+
+        while (data.startsWith(magic) && offset + headerSize <= data.size())
+        {
+            const uchar *record = base + offset;
+            const quint16 type = qFromLittleEndian<quint16>(record);
+            const quint16 size = qFromLittleEndian<quint16>(record + 2);
+
+            if (type == EndRecord || offset + recordSize(size) > data.size())
+                break;
+
+            const QString &payload = QString::fromUtf8(
+                        reinterpret_cast<const char *>(record + headerSize),
+                        size);
+            const int separator = payload.indexOf('\n');
+
+            if (type == SendRecord && separator != -1)
+            {
+                m_inFlight.insert(payload.left(separator),
+                                  payload.mid(separator + 1));
+            }
+            else if (type == CompleteRecord)
+                m_inFlight.remove(payload);
+
+            offset += recordSize(size);
+        }
+
+        /* renaming over an open file fails on Windows */
+        previous.close();
+    }
+
+    for (it = m_inFlight.cbegin(); it != m_inFlight.cend(); it++)
+        m_interrupted.insert(it.key(), it.value());
+
+    return compact();
+}
+
+void
+QXfsJournal::clearInterrupted()
+{
+    foreach (const QString &key, m_interrupted.keys())
+        complete(key);
+
+    m_interrupted.clear();
+}
+
+bool
+QXfsJournal::sent(const QString &msgid, const QString &dwCommand)
+{
+    const QString &key = m_run + ':' + msgid;
+
+    /* appended first, a compaction it triggers need not carry it */
+    if (!append(SendRecord, (key + '\n' + dwCommand).toUtf8()))
+        return false;
+
+    m_inFlight.insert(key, dwCommand);
+
+    return true;
+}
+
+void
+QXfsJournal::completed(const QString &msgid)
+{
+    complete(m_run + ':' + msgid);
+}
+
+void
+QXfsJournal::complete(const QString &key)
+{
+    /* should the record be lost, the next run reports it interrupted */
+    if (m_inFlight.remove(key))
+        append(CompleteRecord, key.toUtf8());
+}
+
+bool
+QXfsJournal::append(RecordType type, const QByteArray &payload)
+{
+    const qint64 size = recordSize(payload.size());
+
+    if (!m_data || payload.size() > 0xffff)
+        return false;
+
+    /* extending costs a truncate and a mapping, compacting a rename and a
+     * sync, which is only worth it once completed commands fill the file
+     */
+    if (m_offset + size > m_capacity &&
+        !(m_capacity < maxGrowCapacity
+          ? grow(qMax(m_capacity * 2, m_offset + size)) : compact()))
+    {
+        return false;
+    }
+
+    /* a record larger than what compaction leaves free is not journaled */
+    if (m_offset + size > m_capacity)
+        return false;
+
+    writeRecord(m_data + m_offset, type, payload);
+    m_offset += size;
+
+    return true;
+}
+
+bool
+QXfsJournal::grow(qint64 capacity)
+{
+    uchar *data;
+
+    /* the new space reads as end records, i.e. zeros */
+    if (!m_file->resize(capacity) || !(data = m_file->map(0, capacity)))
+    {
+        warning(m_file->errorString());
+        return false;
+    }
+
+    m_file->unmap(m_data);
+    m_data = data;
+    m_capacity = capacity;
+
+    return true;
+}
+
+bool
+QXfsJournal::compact()
+{
+    QList<QByteArray> payloads;
+    QHash<QString, QString>::const_iterator it;
+    qint64 offset = sizeof(journalMagic);
+    qint64 capacity = m_capacity;
+    QSaveFile out(m_file->fileName());
+    const bool wasMapped = m_data;
+    QString errorString;
+    QByteArray data;
+
+    for (it = m_inFlight.cbegin(); it != m_inFlight.cend(); it++)
+    {
+        payloads.append((it.key() + '\n' + it.value()).toUtf8());
+        offset += recordSize(payloads.last().size());
+    }
+
+    while (offset > capacity / 2)
+        capacity *= 2;
+
+    data.fill('\0', int(capacity));
+    memcpy(data.data(), journalMagic, sizeof(journalMagic));
+    offset = sizeof(journalMagic);
+
+    foreach (const QByteArray &payload, payloads)
+    {
+        writeRecord(reinterpret_cast<uchar *>(data.data()) + offset,
+                    SendRecord, payload);
+        offset += recordSize(payload.size());
+    }
+
+    /* the old file stays in place until the new one is complete; it is
+     * only unmapped and closed for the rename, which Windows refuses on
+     * an open file
+     */
+    if (!out.open(QIODevice::WriteOnly) || out.write(data) != data.size())
+    {
+        errorString = out.errorString();
+        goto journal_err;
+    }
+
+    if (m_data)
+    {
+        m_file->unmap(m_data);
+        m_data = nullptr;
+    }
+
+    m_file->close();
+
+    if (!out.commit())
+    {
+        errorString = out.errorString();
+
+        /* back to the old file, journaling goes on there */
+        if (wasMapped && m_file->open(QIODevice::ReadWrite))
+            m_data = m_file->map(0, m_capacity);
+
+        goto journal_err;
+    }
+
+    if (!m_file->open(QIODevice::ReadWrite) ||
+        !(m_data = m_file->map(0, capacity)))
+    {
+        errorString = m_file->errorString();
+        goto journal_err;
+    }
+
+    m_capacity = capacity;
+    m_offset = offset;
+
+    return true;
+
+journal_err:
+    warning(errorString);
+
+    return false;
+}
+
+void
+QXfsJournal::warning(const QString &errorString) const
+{
+    QXfsLog::warning("journal/" + m_file->fileName(),
+                     QString("%1 - unable to write journal: %2")
+                     .arg(m_file->fileName(), errorString),
+                     {{"file", m_file->fileName()}, {"error", errorString}});
+}
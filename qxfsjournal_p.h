@@ -0,0 +1,117 @@
+#ifndef QXFSJOURNAL_P_H
+#define QXFSJOURNAL_P_H
+
+#include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QScopedPointer>
+#include <QString>
+
+/**
+ * @class QXfsJournal
+ * @brief Memory-mapped, append-only record of the commands a proxy sent
+ *        and saw completed, telling after a crash which were in flight.
+ *
+ * @details
+ * The file holds a magic followed by records: a 16-bit type and a 16-bit
+ * payload size (little endian), then the payload padded to 4 bytes; the
+ * payload is the key of the command and, for sends, a newline and the
+ * command name. Keys are the msgid prefixed with a uuid generated per run,
+ * "<run>:<msgid>", as request ids may restart with every process.
+ * The type is stored last and commits the record, so replay stops at the
+ * first record a crash interrupted, where the type is still 0.
+ *
+ * Appending is a copy into the mapping, no system call. The mapping
+ * outlives a crash of the process; a crash of the system may lose the
+ * records not yet written back by the kernel.
+ *
+ * A full file is extended in place and mapped again, up to a limit past
+ * which it is replaced, atomically through QSaveFile, by one holding only
+ * the commands still in flight; open() starts every run that way. The old
+ * file stays mapped until its replacement is.
+ */
+class QXfsJournal
+{
+public:
+    explicit QXfsJournal(const QString &fileName);
+    ~QXfsJournal();
+
+    /**
+     * @brief Replays what a previous run left in the file and starts a
+     *        fresh one carrying the commands it left in flight.
+     *
+     * @return bool False if the file cannot be written or mapped.
+     */
+    bool open();
+
+    /**
+     * @brief Returns the commands in flight when the previous run stopped.
+     *
+     * @return QMap Command keys mapped to their command names.
+     */
+    QMap<QString, QString> interrupted() const {return m_interrupted;}
+
+    /**
+     * @brief Drops the interrupted commands once they were reconciled.
+     */
+    void clearInterrupted();
+
+    /**
+     * @brief Records that @p msgid was sent.
+     *
+     * @return bool False if the record could not be written; the command
+     *         would not be known after a crash.
+     */
+    bool sent(const QString &msgid, const QString &dwCommand);
+    void completed(const QString &msgid);
+
+private:
+    enum RecordType
+    {
+        EndRecord,      /**< Unused space, or an interrupted append. */
+        SendRecord,
+        CompleteRecord
+    };
+
+    /**
+     * @brief Appends a record, growing or compacting the file first if it
+     *        is full.
+     */
+    bool append(RecordType type, const QByteArray &payload);
+
+    /**
+     * @brief Extends the file to @p capacity and maps it again.
+     */
+    bool grow(qint64 capacity);
+
+    /**
+     * @brief Rewrites the file with the commands in flight only.
+     */
+    bool compact();
+
+    /**
+     * @brief Records the completion of the command under @p key.
+     */
+    void complete(const QString &key);
+
+    void warning(const QString &errorString) const;
+
+    QScopedPointer<QFile> m_file;
+
+    /**
+     * @brief Prefix of the keys of this run.
+     */
+    QString m_run;
+    uchar *m_data;
+    qint64 m_capacity;
+    qint64 m_offset;
+
+    /**
+     * @brief Commands without a completion record, interrupted included,
+     *        by key.
+     */
+    QHash<QString, QString> m_inFlight;
+    QMap<QString, QString> m_interrupted;
+};
+
+#endif // QXFSJOURNAL_P_H
@@ -0,0 +1,410 @@
+#include <QDebug>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QStringList>
+#include <QThread>
+#include <QWaitCondition>
+
+#include "qxfsclock.h"
+#include "qxfslog.h"
+
+/**
+ * @brief Maximum number of records waiting for the logging thread.
+ *
+ * Records posted beyond it are dropped and counted per key, up to as many
+ * keys.
+ */
+static const int maxQueuedRecords = 1024;
+
+/**
+ * @brief Interval at which the logging thread flushes due summaries.
+ */
+static const unsigned long summaryTickMs = 1000;
+
+/**
+ * @brief Record time, from QXfsClock so rate limits follow a simulated
+ *        clock.
+ */
+static qint64
+timestamp()
+{
+    return QXfsClock::instance()->msecsSinceEpoch();
+}
+
+struct QXfsLogRecord
+{
+    QXfsLog::Severity severity;
+    QString key;
+    QString text;
+    QVariantMap fields;
+    qint64 timestamp;
+    QXfsLog::Formatter format;
+};
+
+/**
+ * @brief Builds the text and fields of @p record, if it was posted with a
+ *        formatter.
+ */
+static void
+format(QXfsLogRecord &record)
+{
+    if (!record.format)
+        return;
+
+    record.format(record.text, record.fields);
+    record.format = nullptr;
+}
+
+/**
+ * @class QXfsLogWorker
+ * @brief Logging thread applying the rate limits and writing records.
+ */
+class QXfsLogWorker : public QThread
+{
+public:
+    QXfsLogWorker();
+    ~QXfsLogWorker();
+
+    void post(const QXfsLogRecord &record);
+    void setSink(const QXfsLog::Sink &sink);
+    void setRateLimit(int burst, int windowMs);
+
+protected:
+    virtual void run();
+
+private:
+    /**
+     * @brief Rate limiting state of one key, owned by the logging thread.
+     */
+    struct KeyState
+    {
+        qint64 windowStart = 0;
+        int count = 0;
+        int suppressed = 0;
+        QXfsLogRecord last;
+    };
+
+    void process(const QXfsLogRecord &record, int burst, qint64 window,
+                 const QXfsLog::Sink &sink);
+    bool drop(const QString &key, int count);
+    void summarize(qint64 now, qint64 window, bool all,
+                   const QXfsLog::Sink &sink);
+    static void summarize(const KeyState &state, const QXfsLog::Sink &sink);
+    static void write(const QVariantMap &record, const QXfsLog::Sink &sink);
+
+    QMutex m_mutex;
+    QWaitCondition m_wake;
+    QList<QXfsLogRecord> m_queue;
+    QHash<QString, int> m_droppedKeys;
+    int m_dropped;
+    bool m_stop;
+    QXfsLog::Sink m_sink;
+    int m_burst;
+    qint64 m_window;
+
+    QHash<QString, KeyState> m_keys;
+};
+
+Q_GLOBAL_STATIC(QXfsLogWorker, logWorker)
+
+QXfsLogWorker::QXfsLogWorker() :
+    m_dropped(0),
+    m_stop(false),
+    m_burst(3),
+    m_window(60000)
+{
+    setObjectName("qxfs-log");
+    start(QThread::LowPriority);
+}
+
+QXfsLogWorker::~QXfsLogWorker()
+{
+    {
+        QMutexLocker lock(&m_mutex);
+
+        m_stop = true;
+        m_wake.wakeOne();
+    }
+
+    wait();
+}
+
+void
+QXfsLogWorker::post(const QXfsLogRecord &record)
+{
+    QMutexLocker lock(&m_mutex);
+
+    if (m_queue.size() >= maxQueuedRecords)
+    {
+        if (m_droppedKeys.size() < maxQueuedRecords ||
+            m_droppedKeys.contains(record.key))
+        {
+            m_droppedKeys[record.key]++;
+        }
+        else
+        {
+            m_dropped++;
+        }
+
+        return;
+    }
+
+    m_queue.append(record);
+    m_wake.wakeOne();
+}
+
+void
+QXfsLogWorker::setSink(const QXfsLog::Sink &sink)
+{
+    QMutexLocker lock(&m_mutex);
+
+    m_sink = sink;
+}
+
+void
+QXfsLogWorker::setRateLimit(int burst, int windowMs)
+{
+    QMutexLocker lock(&m_mutex);
+
+    m_burst = qMax(burst, 1);
+    m_window = qMax(windowMs, 1);
+}
+
+void
+QXfsLogWorker::run()
+{
+    QMutexLocker lock(&m_mutex);
+
+    for (;;)
+    {
+        if (m_queue.isEmpty() && !m_stop)
+            m_wake.wait(&m_mutex, summaryTickMs);
+
+        QList<QXfsLogRecord> batch;
+        QHash<QString, int> droppedKeys;
+        QVariantMap unsummarized;
+        int dropped = m_dropped;
+        const bool stop = m_stop;
+        const QXfsLog::Sink sink = m_sink;
+        const int burst = m_burst;
+        const qint64 window = m_window;
+
+        batch.swap(m_queue);
+        droppedKeys.swap(m_droppedKeys);
+        m_dropped = 0;
+
+        lock.unlock();
+
+        foreach (const QXfsLogRecord &record, batch)
+            process(record, burst, window, sink);
+
+        QHash<QString, int>::const_iterator it;
+
+        for (it = droppedKeys.cbegin(); it != droppedKeys.cend(); ++it)
+        {
+            if (drop(it.key(), it.value()))
+                continue;
+
+            dropped += it.value();
+            unsummarized.insert(it.key(), it.value());
+        }
+
+        if (dropped)
+        {
+            process({QXfsLog::Warning, "qxfs/log",
+                     QString("%1 log records dropped").arg(dropped),
+                     {{"dropped", dropped}, {"keys", unsummarized}},
+                     timestamp(), nullptr},
+                    burst, window, sink);
+        }
+
+        summarize(timestamp(), window, stop, sink);
+
+        lock.relock();
+
+        if (stop && m_queue.isEmpty())
+            return;
+    }
+}
+
+void
+QXfsLogWorker::process(const QXfsLogRecord &record, int burst,
+                       qint64 window, const QXfsLog::Sink &sink)
+{
+    KeyState &state = m_keys[record.key];
+
+    if (state.count == 0 || record.timestamp - state.windowStart >= window)
+    {
+        summarize(state, sink);
+
+        state.windowStart = record.timestamp;
+        state.count = 0;
+        state.suppressed = 0;
+    }
+
+    state.count++;
+    state.last = record;
+
+    if (state.count > burst)
+    {
+        /* formatted only if it ends up in the summary */
+        state.suppressed++;
+        return;
+    }
+
+    format(state.last);
+
+    write({
+        {"severity", record.severity},
+        {"key", record.key},
+        {"text", state.last.text},
+        {"fields", state.last.fields},
+        {"timestamp", record.timestamp}
+    }, sink);
+}
+
+/**
+ * @brief Counts @p count records of @p key, dropped on a full queue, in the
+ *        summary of the key.
+ *
+ * @return bool False if the key has no record in its window to summarize
+ *         them with.
+ */
+bool
+QXfsLogWorker::drop(const QString &key, int count)
+{
+    QHash<QString, KeyState>::iterator it = m_keys.find(key);
+
+    if (it == m_keys.end())
+        return false;
+
+    it->count += count;
+    it->suppressed += count;
+
+    return true;
+}
+
+void
+QXfsLogWorker::summarize(qint64 now, qint64 window, bool all,
+                         const QXfsLog::Sink &sink)
+{
+    QHash<QString, KeyState>::iterator it = m_keys.begin();
+
+    while (it != m_keys.end())
+    {
+        if (!all && now - it->windowStart < window)
+        {
+            ++it;
+            continue;
+        }
+
+        summarize(it.value(), sink);
+
+        /* keys only live while they are active, so an error storm over
+         * many devices does not grow the table past its duration
+         */
+        it = m_keys.erase(it);
+    }
+}
+
+void
+QXfsLogWorker::summarize(const KeyState &state, const QXfsLog::Sink &sink)
+{
+    if (!state.suppressed)
+        return;
+
+    QXfsLogRecord last = state.last;
+
+    format(last);
+
+    qint64 span = qMax(last.timestamp - state.windowStart, qint64(1000));
+
+    write({
+        {"severity", last.severity},
+        {"key", last.key},
+        {"text", QString("%1 (%2 times in %3s)").arg(last.text)
+                                                 .arg(state.count)
+                                                 .arg(span / 1000)},
+        {"fields", last.fields},
+        {"timestamp", last.timestamp},
+        {"count", state.count},
+        {"window", span}
+    }, sink);
+}
+
+void
+QXfsLogWorker::write(const QVariantMap &record, const QXfsLog::Sink &sink)
+{
+    if (sink)
+    {
+        sink(record);
+        return;
+    }
+
+    QString line = record["text"].toString();
+    const QVariantMap &fields = record["fields"].toMap();
+
+    if (!fields.isEmpty())
+    {
+        QStringList l;
+        QVariantMap::const_iterator it;
+
+        for (it = fields.cbegin(); it != fields.cend(); it++)
+            l.append(it.key() + "=" + it.value().toString());
+
+        line += " [" + l.join(" ") + "]";
+    }
+
+    switch (record["severity"].toInt())
+    {
+    case QXfsLog::Debug:
+        qDebug("%s", qPrintable(line));
+        break;
+    case QXfsLog::Info:
+        qInfo("%s", qPrintable(line));
+        break;
+    case QXfsLog::Warning:
+        qWarning("%s", qPrintable(line));
+        break;
+    default:
+        qCritical("%s", qPrintable(line));
+        break;
+    }
+}
+
+void
+QXfsLog::log(Severity severity, const QString &key, const QString &text,
+             const QVariantMap &fields)
+{
+    /* records posted while the process is tearing down are discarded */
+    if (QXfsLogWorker *worker = logWorker)
+    {
+        worker->post({severity, key, text, fields,
+                      timestamp(), nullptr});
+    }
+}
+
+void
+QXfsLog::log(Severity severity, const QString &key, const Formatter &format)
+{
+    if (QXfsLogWorker *worker = logWorker)
+    {
+        worker->post({severity, key, QString(), QVariantMap(),
+                      timestamp(), format});
+    }
+}
+
+void
+QXfsLog::setSink(const Sink &sink)
+{
+    if (QXfsLogWorker *worker = logWorker)
+        worker->setSink(sink);
+}
+
+void
+QXfsLog::setRateLimit(int burst, int windowMs)
+{
+    if (QXfsLogWorker *worker = logWorker)
+        worker->setRateLimit(burst, windowMs);
+}
@@ -0,0 +1,101 @@
+#ifndef QXFSLOG_H
+#define QXFSLOG_H
+
+#include <QVariantMap>
+
+#include <functional>
+
+#include "qxfs_global.h"
+
+/**
+ * @class QXfsLog
+ * @brief Asynchronous, rate-limited structured logging for the library.
+ *
+ * @details
+ * Records are queued by the calling thread and formatted, rate-limited
+ * and written by a dedicated logging thread, so an error storm costs the
+ * hot thread one bounded enqueue per record. Hot paths pass a Formatter,
+ * which builds the text and fields on the logging thread, and only for
+ * the records that are written.
+ *
+ * Records sharing a key are limited to a burst per window; occurrences
+ * beyond that are counted and reported once per window as a summary,
+ * e.g. "CDM1 - unable to connect to device server (120 times in 60s)".
+ */
+class QXFS_EXPORT QXfsLog
+{
+public:
+    enum Severity
+    {
+        Debug,
+        Info,
+        Warning,
+        Critical
+    };
+
+    /**
+     * @brief Receives formatted records on the logging thread.
+     *
+     * The record map carries "severity", "key", "text", "fields",
+     * "timestamp" (ms since epoch) and, for summaries, "count" and
+     * "window" (ms).
+     */
+    using Sink = std::function<void(const QVariantMap &record)>;
+
+    /**
+     * @brief Builds the text and fields of a record, on the logging thread.
+     *
+     * Captures by value: the record outlives the calling scope.
+     */
+    using Formatter = std::function<void(QString &text, QVariantMap &fields)>;
+
+    /**
+     * @brief Queues a record for asynchronous output.
+     *
+     * @param severity Record severity.
+     * @param key Rate limiting key, e.g. "connect/<deviceId>".
+     * @param text Human readable message.
+     * @param fields Structured context (device, command, hResult...).
+     */
+    static void log(Severity severity, const QString &key,
+                    const QString &text,
+                    const QVariantMap &fields = QVariantMap());
+
+    /**
+     * @brief Queues a record formatted by @p format for asynchronous output.
+     */
+    static void log(Severity severity, const QString &key,
+                    const Formatter &format);
+
+    static void warning(const QString &key, const Formatter &format)
+    {
+        log(Warning, key, format);
+    }
+
+    static void warning(const QString &key, const QString &text,
+                        const QVariantMap &fields = QVariantMap())
+    {
+        log(Warning, key, text, fields);
+    }
+
+    static void critical(const QString &key, const QString &text,
+                         const QVariantMap &fields = QVariantMap())
+    {
+        log(Critical, key, text, fields);
+    }
+
+    /**
+     * @brief Replaces the output sink; an empty sink restores the default,
+     *        which writes through qWarning()/qCritical().
+     */
+    static void setSink(const Sink &sink);
+
+    /**
+     * @brief Limits every key to @p burst records per @p windowMs.
+     *
+     * Defaults to 3 records per 60 seconds.
+     */
+    static void setRateLimit(int burst, int windowMs);
+};
+
+#endif // QXFSLOG_H
@@ -0,0 +1,95 @@
+#ifndef QXFSSNAPSHOT_P_H
+#define QXFSSNAPSHOT_P_H
+
+#include <QMutex>
+#include <QThread>
+
+#include <atomic>
+
+/**
+ * @class QXfsSnapshot
+ * @brief Immutable value published for lock-free readers.
+ *
+ * @details
+ * Readers take a copy of the current value with no lock: a pointer load
+ * and, for implicitly shared Qt types, a reference count increment.
+ * Writers publish a new value by swapping the pointer and reclaim the old
+ * one once no reader can still be copying it; readers never wait.
+ *
+ * Readers register in one of two counters, chosen by an epoch the writer
+ * flips, so a writer only waits for the readers that were copying when it
+ * published, however many keep arriving.
+ */
+template <typename T>
+class QXfsSnapshot
+{
+public:
+    QXfsSnapshot() : m_current(new T), m_epoch(0)
+    {
+        m_readers[0] = 0;
+        m_readers[1] = 0;
+    }
+    ~QXfsSnapshot() {delete m_current.load();}
+
+    QXfsSnapshot(const QXfsSnapshot &) = delete;
+    QXfsSnapshot &operator=(const QXfsSnapshot &) = delete;
+
+    /**
+     * @brief Returns a copy of the current value.
+     */
+    T load() const
+    {
+        /* the reader count must be published before the pointer is read,
+         * all operations are sequentially consistent for that reason
+         */
+        std::atomic<int> &readers = m_readers[m_epoch.load()];
+
+        readers.fetch_add(1);
+        T rv = *m_current.load();
+        readers.fetch_sub(1);
+
+        return rv;
+    }
+
+    /**
+     * @brief Publishes @p value as the current value.
+     */
+    void store(const T &value)
+    {
+        QMutexLocker lock(&m_writer);
+        T *old = m_current.exchange(new T(value));
+
+        /* grace period: after a flip new readers count in the other
+         * counter, so each wait only covers readers already copying, which
+         * are done within a few instructions; two flips also cover those
+         * that picked their counter before an earlier store
+         */
+        for (int pass = 0; pass < 2; pass++)
+        {
+            const int epoch = m_epoch.load();
+
+            m_epoch.store(epoch ^ 1);
+
+            while (m_readers[epoch].load())
+                QThread::yieldCurrentThread();
+        }
+
+        delete old;
+    }
+
+private:
+    std::atomic<T *> m_current;
+
+    /**
+     * @brief Counter new readers register in, 0 or 1.
+     */
+    std::atomic<int> m_epoch;
+    mutable std::atomic<int> m_readers[2];
+
+    /**
+     * @brief Serializes writers; never taken by readers.
+     */
+    QMutex m_writer;
+};
+
+#endif // QXFSSNAPSHOT_P_H
@@ -1,31 +1,72 @@
 #include <QDataStream>
 #include <QLocalSocket>
 #include <QSslSocket>
-#include <QSet>
-#include <QMutex>
 
+#include "qxfsconnection_p.h"
+#include "qxfslog.h"
 #include "qxfssocketstream.h"
 
-Q_GLOBAL_STATIC(QSet<QString>, warnOnce)
-Q_GLOBAL_STATIC(QMutex, warnOnceMutex)
+/**
+ * @class QXfsSocketConnection
+ * @brief Local or TCP/SSL socket connection to a device server.
+ */
+class QXfsSocketConnection : public QXfsConnection
+{
+public:
+    QXfsSocketConnection(const QString &deviceAddress,
+                         const QString &deviceId);
+    ~QXfsSocketConnection();
+
+    /**
+     * @brief Attempts to establish a connection to the backend service,
+     *        waiting up to @p msecs.
+     *
+     * @return bool True on successful connection; otherwise false.
+     */
+    virtual bool open(int msecs = 30000);
+
+private:
+    QIODevice *createSocket(const QString &deviceAddress,
+                            const QString &deviceId);
+
+private:
+
+    /**
+     * @brief True if the connection target is local (QLocalSocket).
+     */
+    bool m_isLocal;
+
+    /**
+     * @brief True if SSL/TLS is negotiated for the connection.
+     */
+    bool m_isSsl;
+
+    /**
+     * @brief Hostname or endpoint for remote connections.
+     */
+    QString m_host;
+
+    /**
+     * @brief Port for remote TCP/SSL connections.
+     */
+    quint16 m_port;
+};
 
 QIODevice *
-QXfsSocketStream::createSocket(const QString &deviceAddress,
-                               const QString &deviceId)
+QXfsSocketConnection::createSocket(const QString &deviceAddress,
+                                   const QString &deviceId)
 {
-    m_socket = nullptr;
-    m_host = new QString();
     m_isLocal = (deviceAddress == "local");
     m_isSsl = false;
 
     if (m_isLocal)
     {
-        QLocalSocket *socket = new QLocalSocket;
-
-        m_socket = socket;
+        QLocalSocket *socket = new QLocalSocket(this);
 
         socket->setServerName("printec.ndc.device." + deviceId);
         socket->connectToServer();
+
+        return socket;
     }
     else
     {
@@ -34,7 +75,7 @@ QXfsSocketStream::createSocket(const QString &deviceAddress,
         if (deviceAddress.startsWith("tcp://") ||
             (m_isSsl = deviceAddress.startsWith("ssl://")))
         {
-            socket = new QSslSocket;
+            socket = new QSslSocket(this);
         }
         else
         {
@@ -44,77 +85,68 @@ bad_address:
             return nullptr;
         }
 
-        m_socket = socket;
-
         QStringList l = deviceAddress.mid(6).split(":");
 
         if (l.size() != 2)
+        {
+            delete socket;
             goto bad_address;
+        }
 
         bool ok;
 
-        *m_host = l.at(0);
+        m_host = l.at(0);
         m_port = l.at(1).toUInt(&ok);
 
         if (!ok)
+        {
+            delete socket;
             goto bad_address;
+        }
 
         if (m_isSsl)
-            socket->connectToHostEncrypted(*m_host, m_port);
+            socket->connectToHostEncrypted(m_host, m_port);
         else
-            socket->connectToHost(*m_host, m_port);
-    }
-
-    return m_socket;
-}
+            socket->connectToHost(m_host, m_port);
 
-QXfsSocketStream::QXfsSocketStream(const QString &deviceAddress,
-                                   const QString &deviceId,
-                                   const QString &strClass,
-                                   QObject *parent) :
-    QXfsStream(createSocket(deviceAddress, deviceId), deviceId, strClass,
-               parent)
-{
-    connect(m_socket, SIGNAL(disconnected()), SLOT(disconnected()));
+        return socket;
+    }
 }
 
-QXfsSocketStream::~QXfsSocketStream()
+QXfsSocketConnection::QXfsSocketConnection(const QString &deviceAddress,
+                                           const QString &deviceId) :
+    QXfsConnection(deviceId)
 {
-    delete m_host;
-    m_socket->disconnect();
-    m_socket->deleteLater();
+    setIo(createSocket(deviceAddress, deviceId));
 }
 
-void
-QXfsSocketStream::disconnected()
+QXfsSocketConnection::~QXfsSocketConnection()
 {
-    QMap<QString, QString> commands = pending();
-    QMap<QString, QString>::const_iterator it;
-    QVariantMap msg = {{"hResult", "WFS_ERR_CONNECTION_LOST"}};
-
-    for (it = commands.cbegin(); it != commands.cend(); it++)
-    {
-        msg["msgid"] = it.key();
-        msg["dwCommandCode"] = it.value();
-
-        emit message(msg);
-    }
+    /* the socket is a child and goes away with us, but must not report its
+     * disconnection to a half-destroyed connection
+     */
+    if (io())
+        io()->disconnect(this);
 }
 
 bool
-QXfsSocketStream::connectToServer(QIODevice *io)
+QXfsSocketConnection::open(int msecs)
 {
+    const QString device = objectName();
     QString errorString;
 
+    if (!io())
+        return false;
+
     if (m_isLocal)
     {
-        QLocalSocket *socket = static_cast<QLocalSocket *>(io);
+        QLocalSocket *socket = static_cast<QLocalSocket *>(io());
 
         if (socket->state() != QLocalSocket::ConnectedState)
         {
             socket->connectToServer();
 
-            if (!socket->waitForConnected())
+            if (!socket->waitForConnected(msecs))
             {
                 errorString = socket->errorString();
                 goto conn_err;
@@ -123,7 +155,7 @@ QXfsSocketStream::connectToServer(QIODevice *io)
     }
     else
     {
-        QSslSocket *socket = static_cast<QSslSocket *>(io);
+        QSslSocket *socket = static_cast<QSslSocket *>(io());
         bool connected;
 
         if (socket->state() != QAbstractSocket::ConnectedState ||
@@ -134,20 +166,20 @@ QXfsSocketStream::connectToServer(QIODevice *io)
                 if (socket->state() == QAbstractSocket::UnconnectedState ||
                     socket->state() == QAbstractSocket::ClosingState)
                 {
-                    socket->connectToHostEncrypted(*m_host, m_port);
+                    socket->connectToHostEncrypted(m_host, m_port);
                 }
 
-                connected = socket->waitForEncrypted();
+                connected = socket->waitForEncrypted(msecs);
             }
             else
             {
                 if (socket->state() == QAbstractSocket::UnconnectedState ||
                     socket->state() == QAbstractSocket::ClosingState)
                 {
-                    socket->connectToHost(*m_host, m_port);
+                    socket->connectToHost(m_host, m_port);
                 }
 
-                connected = socket->waitForConnected();
+                connected = socket->waitForConnected(msecs);
             }
 
             if (!connected)
@@ -158,21 +190,42 @@ QXfsSocketStream::connectToServer(QIODevice *io)
         }
     }
 
+    negotiate();
+
     return true;
 
 conn_err:
+    QXfsLog::warning("connect/" + device,
+                     [device, errorString](QString &text, QVariantMap &fields)
     {
-        QMutexLocker lock(warnOnceMutex);
-        const auto &on {objectName()};
+        text = QString("%1 - unable to connect to device server: %2")
+               .arg(device, errorString);
+        fields = {{"device", device}, {"error", errorString}};
+    });
 
-        if (!warnOnce->contains(on))
-        {
-            warnOnce->insert(on);
+    return false;
+}
 
-            qWarning() << on << " - unable to connect to device server: "
-                       << errorString;
-        }
-    }
+QSharedPointer<QXfsConnection>
+QXfsSocketStream::sharedConnection(const QString &deviceAddress,
+                                   const QString &deviceId)
+{
+    return QXfsConnection::shared(deviceAddress + "|" + deviceId,
+    [&]() -> QXfsConnection *
+    {
+        return new QXfsSocketConnection(deviceAddress, deviceId);
+    });
+}
 
-    return false;
+QXfsSocketStream::QXfsSocketStream(const QString &deviceAddress,
+                                   const QString &deviceId,
+                                   const QString &strClass,
+                                   QObject *parent) :
+    QXfsStream(sharedConnection(deviceAddress, deviceId), deviceId, strClass,
+               parent)
+{
+}
+
+QXfsSocketStream::~QXfsSocketStream()
+{
 }
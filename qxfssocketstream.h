@@ -15,52 +15,15 @@ public:
                               QObject *parent = nullptr);
     ~QXfsSocketStream();
 
-protected:
-    /**
-     * @brief Attempts to establish a connection to the backend service.
-     *
-     * @return bool True on successful connection; otherwise false.
-     */
-    virtual bool connectToServer(QIODevice *io);
-
-protected slots:
-    /**
-     * @brief Slot invoked when the socket disconnects.
-     *
-     * Performs cleanup and may emit diagnostics or state transitions.
-     */
-    void disconnected();
-
-private:
-    QIODevice *createSocket(const QString &deviceAddress,
-                            const QString &deviceId);
-
 private:
-
-    /**
-     * @brief The connection socket.
-     */
-    QIODevice *m_socket;
-
-    /**
-     * @brief True if the connection target is local (QLocalSocket).
-     */
-    bool m_isLocal;
-
-    /**
-     * @brief True if SSL/TLS is negotiated for the connection.
-     */
-    bool m_isSsl;
-
-    /**
-     * @brief Hostname or endpoint for remote connections.
-     */
-    QString *m_host;
-
     /**
-     * @brief Port for remote TCP/SSL connections.
+     * @brief Returns the connection shared by all proxies of a device.
+     *
+     * @param deviceAddress "local", "tcp://host:port" or "ssl://host:port".
+     * @param deviceId Logical identifier of the target device instance.
      */
-    quint16 m_port;
+    static QSharedPointer<QXfsConnection> sharedConnection(
+            const QString &deviceAddress, const QString &deviceId);
 };
 
 #endif // QXFSSOCKETSTREAM_H
@@ -0,0 +1,263 @@
+#include <QDataStream>
+#include <QThread>
+
+#include <atomic>
+#include <cstring>
+
+#include "qxfslog.h"
+#include "qxfsstateboard.h"
+
+/**
+ * @brief Leading word of a board segment.
+ */
+static const quint32 boardMagic = 0x42535851; // "QXSB"
+
+/**
+ * @brief Attempts of a reader at a slot being written before it gives up,
+ *        e.g. on a writer that died midway.
+ */
+static const int readAttempts = 1000;
+
+/**
+ * @brief Time given to the publisher that created a segment to initialize
+ *        it, before attaching to it fails.
+ */
+static const int initializeWaitMs = 1000;
+
+/**
+ * @brief Segment header, followed by the slots.
+ */
+struct QXfsStateBoardHeader
+{
+    std::atomic<quint32> magic;
+    quint32 slotSize;
+};
+
+/**
+ * @brief Slot of an entry, followed by its data.
+ */
+struct QXfsStateBoard::Slot
+{
+    std::atomic<quint64> sequence;
+    std::atomic<quint32> size;
+    quint32 reserved;
+
+    char *data() {return reinterpret_cast<char *>(this + 1);}
+};
+
+static int
+headerSize()
+{
+    return (sizeof(QXfsStateBoardHeader) + 7) & ~7;
+}
+
+QXfsStateBoard::QXfsStateBoard(const QString &deviceId) :
+    m_memory("qxfs-state/" + deviceId),
+    m_slotSize(0)
+{
+}
+
+QXfsStateBoard::~QXfsStateBoard()
+{
+    m_memory.detach();
+}
+
+bool
+QXfsStateBoard::create(int slotSize)
+{
+    QXfsStateBoardHeader *header;
+
+    m_slotSize = (sizeof(Slot) + slotSize + 7) & ~7;
+
+    if (!m_memory.create(headerSize() + EntryCount * m_slotSize))
+    {
+        if (m_memory.error() == QSharedMemory::AlreadyExists &&
+            m_memory.attach())
+        {
+            return validate();
+        }
+
+        m_errorString = m_memory.errorString();
+        goto board_err;
+    }
+
+    m_memory.lock();
+    header = static_cast<QXfsStateBoardHeader *>(m_memory.data());
+    memset(m_memory.data(), 0, m_memory.size());
+    header->slotSize = m_slotSize;
+
+    /* published last, readers attaching meanwhile see no board yet */
+    header->magic.store(boardMagic, std::memory_order_release);
+    m_memory.unlock();
+
+    return true;
+
+board_err:
+    QXfsLog::warning("board/" + m_memory.key(),
+                     QString("%1 - unable to create state board: %2")
+                     .arg(m_memory.key(), m_errorString),
+                     {{"key", m_memory.key()}, {"error", m_errorString}});
+
+    return false;
+}
+
+bool
+QXfsStateBoard::attach()
+{
+    if (!m_memory.attach(QSharedMemory::ReadOnly))
+    {
+        m_errorString = m_memory.errorString();
+        return false;
+    }
+
+    return validate();
+}
+
+bool
+QXfsStateBoard::validate()
+{
+    const QXfsStateBoardHeader *header =
+            static_cast<const QXfsStateBoardHeader *>(m_memory.constData());
+    quint32 magic = 0;
+    quint32 slotSize = 0;
+
+    /* the creator initializes the segment under the lock, but only takes
+     * it once the segment exists; until then the magic reads 0
+     */
+    for (int waited = 0; m_memory.size() >= headerSize(); waited++)
+    {
+        m_memory.lock();
+        magic = header->magic.load(std::memory_order_acquire);
+        slotSize = header->slotSize;
+        m_memory.unlock();
+
+        if (magic || waited >= initializeWaitMs)
+            break;
+
+        QThread::msleep(1);
+    }
+
+    if (magic != boardMagic ||
+        m_memory.size() < headerSize() + EntryCount * int(slotSize))
+    {
+        m_errorString = m_memory.key() + " is not a state board";
+        m_memory.detach();
+        return false;
+    }
+
+    m_slotSize = slotSize;
+
+    return true;
+}
+
+QXfsStateBoard::Slot *
+QXfsStateBoard::slot(Entry entry) const
+{
+    char *base = static_cast<char *>(const_cast<void *>(m_memory.constData()));
+
+    return reinterpret_cast<Slot *>(base + headerSize() + entry * m_slotSize);
+}
+
+bool
+QXfsStateBoard::publish(Entry entry, const QVariantMap &value)
+{
+    const int capacity = m_slotSize - int(sizeof(Slot));
+    QByteArray data;
+    QDataStream ds(&data, QIODevice::WriteOnly);
+    Slot *s;
+    quint64 sequence;
+
+    if (!m_memory.isAttached() || entry >= EntryCount)
+        return false;
+
+    ds << value;
+
+    if (data.size() > capacity)
+    {
+        QXfsLog::warning("board/" + m_memory.key(),
+                         QString("%1 - %2 bytes of state exceed the slot")
+                         .arg(m_memory.key()).arg(data.size()));
+        return false;
+    }
+
+    s = slot(entry);
+
+    m_memory.lock();
+
+    /* odd while writing; a writer that died left it odd already */
+    sequence = s->sequence.load(std::memory_order_relaxed) | 1;
+    s->sequence.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy(s->data(), data.constData(), data.size());
+    s->size.store(data.size(), std::memory_order_relaxed);
+
+    s->sequence.store(sequence + 1, std::memory_order_release);
+
+    m_memory.unlock();
+
+    return true;
+}
+
+QVariantMap
+QXfsStateBoard::read(Entry entry, quint64 *version) const
+{
+    const quint32 capacity = m_slotSize - sizeof(Slot);
+    QVariantMap value;
+    QByteArray data;
+    Slot *s;
+
+    if (version)
+        *version = 0;
+
+    if (!m_memory.isAttached() || entry >= EntryCount)
+        return value;
+
+    s = slot(entry);
+
+    for (int attempt = 0; attempt < readAttempts; attempt++)
+    {
+        const quint64 before = s->sequence.load(std::memory_order_acquire);
+
+        if (before & 1)
+        {
+            QThread::yieldCurrentThread();
+            continue;
+        }
+
+        if (!before)
+            return value;
+
+        data = QByteArray(s->data(),
+                          qMin(s->size.load(std::memory_order_relaxed),
+                               capacity));
+
+        /* the copy may be torn, it is only used if no writer came by */
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (s->sequence.load(std::memory_order_relaxed) != before)
+            continue;
+
+        QDataStream ds(data);
+
+        ds >> value;
+
+        if (ds.status() != QDataStream::Ok)
+            value.clear();
+        else if (version)
+            *version = before / 2;
+
+        return value;
+    }
+
+    return value;
+}
+
+quint64
+QXfsStateBoard::version(Entry entry) const
+{
+    if (!m_memory.isAttached() || entry >= EntryCount)
+        return 0;
+
+    return slot(entry)->sequence.load(std::memory_order_acquire) / 2;
+}
@@ -0,0 +1,106 @@
+#ifndef QXFSSTATEBOARD_H
+#define QXFSSTATEBOARD_H
+
+#include <QSharedMemory>
+#include <QVariantMap>
+
+#include "qxfs_global.h"
+
+/**
+ * @class QXfsStateBoard
+ * @brief Latest status and capabilities of a device, in shared memory
+ *        readable by any process of the terminal.
+ *
+ * @details
+ * The proxies of a device publish into the board, see
+ * QXfsStream::setStateBoard(); other processes (UI, monitoring, journal
+ * services) attach to it by device id and read the state without a
+ * round-trip to the service and without locking.
+ *
+ * Each entry sits in a fixed slot versioned by a seqlock: the writer makes
+ * the sequence odd, copies the serialized map in and makes it even again;
+ * a reader copies the slot out and retries if the sequence was odd or
+ * moved meanwhile. Writers of several processes serialize on the
+ * segment's system lock, readers never take it.
+ *
+ * On Unix the segment lives as long as a process is attached to it.
+ */
+class QXFS_EXPORT QXfsStateBoard
+{
+public:
+    /**
+     * @brief Entries of the board.
+     */
+    enum Entry
+    {
+        StatusEntry,        /**< Last WFS_INF_<class>_STATUS lpBuffer. */
+        CapabilitiesEntry,  /**< Last WFS_INF_<class>_CAPABILITIES one. */
+        EntryCount
+    };
+
+    /**
+     * @brief Default slot size; larger maps are not published.
+     */
+    static const int defaultSlotSize = 64 * 1024;
+
+    explicit QXfsStateBoard(const QString &deviceId);
+    ~QXfsStateBoard();
+
+    QXfsStateBoard(const QXfsStateBoard &) = delete;
+    QXfsStateBoard &operator=(const QXfsStateBoard &) = delete;
+
+    /**
+     * @brief Creates the board for publishing, or attaches to the one
+     *        another publisher created.
+     *
+     * @return bool False if the segment cannot be created or is not a
+     *         board.
+     */
+    bool create(int slotSize = defaultSlotSize);
+
+    /**
+     * @brief Attaches to an existing board for reading.
+     */
+    bool attach();
+
+    bool isAttached() const {return m_memory.isAttached();}
+    QString errorString() const {return m_errorString;}
+
+    /**
+     * @brief Replaces @p entry with @p value.
+     *
+     * @return bool False if not created, or @p value does not fit a slot.
+     */
+    bool publish(Entry entry, const QVariantMap &value);
+
+    /**
+     * @brief Returns a consistent copy of @p entry, empty if never
+     *        published or if a publisher died while writing it.
+     *
+     * @param version Set to the version read, see version().
+     */
+    QVariantMap read(Entry entry, quint64 *version = nullptr) const;
+
+    /**
+     * @brief Returns the number of times @p entry was published; a cheap
+     *        check whether read() would return anything new.
+     */
+    quint64 version(Entry entry) const;
+
+private:
+    struct Slot;
+
+    Slot *slot(Entry entry) const;
+
+    /**
+     * @brief Checks the header of an attached segment, waiting briefly for
+     *        the publisher that created it to initialize it.
+     */
+    bool validate();
+
+    mutable QSharedMemory m_memory;
+    int m_slotSize;
+    QString m_errorString;
+};
+
+#endif // QXFSSTATEBOARD_H
@@ -0,0 +1,622 @@
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonDocument>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMutex>
+#include <QSemaphore>
+#include <QThread>
+#include <QWeakPointer>
+
+#include <cstdlib>
+#include <new>
+
+#include "qxfsclock.h"
+#include "qxfsstatistics_p.h"
+
+using QXfsDeviceStatisticsMap =
+        QHash<QString, QWeakPointer<QXfsDeviceStatistics>>;
+
+/**
+ * @brief Global registry of device statistics.
+ */
+Q_GLOBAL_STATIC(QXfsDeviceStatisticsMap, devices)
+
+/**
+ * @brief Mutex protecting device statistics registry.
+ */
+Q_GLOBAL_STATIC(QMutex, devicesMutex)
+
+struct QXfsMonotonicClock
+{
+    QXfsMonotonicClock() :
+        ticks(QXfsDeviceStatistics::ticks())
+    {
+        timer.start();
+    }
+
+    QElapsedTimer timer;
+
+    /**
+     * @brief Stage timer clock when the timer started, to calibrate it.
+     */
+    quint64 ticks;
+};
+
+/**
+ * @brief Time base of request latencies.
+ */
+Q_GLOBAL_STATIC(QXfsMonotonicClock, monotonicClock)
+
+/**
+ * @brief Stage timers of all devices.
+ */
+static QXfsStageCounter processStages[QXfsStatistics::StageCount];
+
+static const char *stageNames[] = {"decode", "queue", "dispatch", "handler"};
+
+static const char *allocationPathNames[] = {"decode", "dispatch", "send"};
+
+static const char *phaseNames[] = {"uplink", "queue", "device", "downlink"};
+
+#ifdef QXFS_ALLOCATION_ACCOUNTING
+thread_local QXfsAllocationCounter *QXfsAllocationScope::current = nullptr;
+
+static inline void
+countAllocation(size_t size)
+{
+    if (QXfsAllocationCounter *counter = QXfsAllocationScope::current)
+        counter->add(size);
+}
+
+#if defined(QXFS_MALLOC_HOOKS) && defined(__GLIBC__)
+/* Qt containers allocate their storage with malloc(), so that is where
+ * allocations are counted; glibc exports its allocator under these names
+ * for wrappers like this one
+ */
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size) noexcept
+{
+    countAllocation(size);
+
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size) noexcept
+{
+    size_t total;
+
+    /* an overflowing request is left to fail in __libc_calloc() */
+    if (!__builtin_mul_overflow(n, size, &total))
+        countAllocation(total);
+
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size) noexcept
+{
+    countAllocation(size);
+
+    return __libc_realloc(ptr, size);
+}
+
+}
+#else
+/* otherwise only allocations through operator new are seen */
+void *
+operator new(size_t size)
+{
+    countAllocation(size);
+
+    if (void *rv = std::malloc(size ? size : 1))
+        return rv;
+
+    throw std::bad_alloc();
+}
+
+void *
+operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *
+operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    countAllocation(size);
+
+    return std::malloc(size ? size : 1);
+}
+
+void *
+operator new[](size_t size, const std::nothrow_t &tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void
+operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void
+operator delete[](void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void
+operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+
+void
+operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+#endif
+#endif
+
+std::atomic<bool> QXfsDeviceStatistics::stageTimers(false);
+
+/**
+ * @brief Rate of QXfsDeviceStatistics::ticks(), measured against the
+ *        monotonic clock since its start.
+ */
+static double
+ticksPerNs()
+{
+#ifdef QXFS_HAVE_RDTSC
+    const qint64 ns = monotonicClock->timer.nsecsElapsed();
+    const quint64 ticks = QXfsDeviceStatistics::ticks();
+
+    if (ns < 1000000)
+        return 1;
+
+    return double(ticks - monotonicClock->ticks) / ns;
+#else
+    return 1;
+#endif
+}
+
+/**
+ * @brief Maps the stage counters @p stages by stage name.
+ */
+static QVariantMap
+stagesToMap(const QXfsStageCounter *stages, double ticksPerNs)
+{
+    QVariantMap rv;
+
+    for (int i = 0; i < QXfsStatistics::StageCount; i++)
+        rv.insert(stageNames[i], stages[i].toMap(ticksPerNs));
+
+    return rv;
+}
+
+/**
+ * @class QXfsStatisticsServer
+ * @brief Thread answering snapshot requests on a local socket.
+ */
+class QXfsStatisticsServer : public QThread
+{
+public:
+    QXfsStatisticsServer() : m_listening(false) {}
+    ~QXfsStatisticsServer() {stop();}
+
+    bool start(const QString &name);
+    void stop();
+
+protected:
+    virtual void run();
+
+private:
+    QString m_name;
+    bool m_listening;
+    QSemaphore m_started;
+};
+
+Q_GLOBAL_STATIC(QXfsStatisticsServer, statisticsServer)
+
+/**
+ * @brief Mutex serializing QXfsStatistics::listen() and close().
+ */
+Q_GLOBAL_STATIC(QMutex, serverMutex)
+
+bool
+QXfsStatisticsServer::start(const QString &name)
+{
+    stop();
+
+    m_name = name;
+    setObjectName("qxfs-stats");
+    QThread::start(QThread::LowPriority);
+    m_started.acquire();
+
+    if (!m_listening)
+        wait();
+
+    return m_listening;
+}
+
+void
+QXfsStatisticsServer::stop()
+{
+    quit();
+    wait();
+}
+
+void
+QXfsStatisticsServer::run()
+{
+    QLocalServer server;
+
+    QLocalServer::removeServer(m_name);
+    m_listening = server.listen(m_name);
+    m_started.release();
+
+    if (!m_listening)
+        return;
+
+    QObject::connect(&server, &QLocalServer::newConnection, [&server]
+    {
+        while (QLocalSocket *socket = server.nextPendingConnection())
+        {
+            QObject::connect(socket, &QLocalSocket::disconnected,
+                             socket, &QObject::deleteLater);
+            QObject::connect(socket, &QLocalSocket::readyRead, [socket]
+            {
+                while (socket->canReadLine())
+                {
+                    const QByteArray &line = socket->readLine().trimmed();
+
+                    if (line == "stages on" || line == "stages off")
+                        QXfsStatistics::setStageTimers(line == "stages on");
+
+                    if (line != "snapshot")
+                        continue;
+
+                    QJsonDocument doc = QJsonDocument::fromVariant(
+                                QXfsStatistics::snapshot());
+
+                    socket->write(doc.toJson(QJsonDocument::Compact));
+                    socket->write("\n");
+                }
+            });
+        }
+    });
+
+    exec();
+}
+
+QXfsDeviceStatistics::QXfsDeviceStatistics() :
+    framesIn(0),
+    framesOut(0),
+    completed(0),
+    disconnects(0),
+    reconnects(0),
+    inFlight(0),
+    queueDepth(0),
+    payloadCacheHits(0),
+    payloadCacheMisses(0),
+    payloadBytesSaved(0)
+{
+    for (int i = 0; i < QXfsStatistics::latencyBuckets; i++)
+        latency[i].store(0, std::memory_order_relaxed);
+
+    for (int i = 0; i < QXfsStatistics::StageCount; i++)
+    {
+        stages[i].count.store(0, std::memory_order_relaxed);
+        stages[i].ticks.store(0, std::memory_order_relaxed);
+    }
+
+    for (int i = 0; i < QXfsStatistics::AllocationPathCount; i++)
+    {
+        allocations[i].count.store(0, std::memory_order_relaxed);
+        allocations[i].bytes.store(0, std::memory_order_relaxed);
+    }
+
+    for (int i = 0; i < QXfsStatistics::PhaseCount; i++)
+    {
+        phases[i].count.store(0, std::memory_order_relaxed);
+        phases[i].ticks.store(0, std::memory_order_relaxed);
+    }
+}
+
+void
+QXfsDeviceStatistics::recordStage(QXfsStatistics::Stage stage,
+                                  quint64 duration)
+{
+    stages[stage].add(duration);
+    processStages[stage].add(duration);
+}
+
+QVariantMap
+QXfsStageCounter::toMap(double ticksPerNs) const
+{
+    const quint64 n = count.load(std::memory_order_relaxed);
+    const quint64 t = ticks.load(std::memory_order_relaxed);
+
+    return
+    {
+        {"count", n},
+        {"ticks", t},
+        {"meanNs", n ? t / ticksPerNs / n : 0.0}
+    };
+}
+
+void
+QXfsDeviceStatistics::recordLatency(qint64 ns)
+{
+    quint64 us = quint64(qMax(ns / 1000, qint64(1)));
+    int bucket = 0;
+
+    while (us >>= 1)
+        bucket++;
+
+    bucket = qMin(bucket, QXfsStatistics::latencyBuckets - 1);
+
+    latency[bucket].fetch_add(1, std::memory_order_relaxed);
+    completed.fetch_add(1, std::memory_order_relaxed);
+}
+
+QVariantMap
+QXfsDeviceStatistics::toMap(double ticksPerNs) const
+{
+    QVariantList histogram;
+
+    for (int i = 0; i < QXfsStatistics::latencyBuckets; i++)
+        histogram.append(latency[i].load(std::memory_order_relaxed));
+
+    QVariantMap rv
+    {
+        {"framesIn", framesIn.load(std::memory_order_relaxed)},
+        {"framesOut", framesOut.load(std::memory_order_relaxed)},
+        {"completed", completed.load(std::memory_order_relaxed)},
+        {"disconnects", disconnects.load(std::memory_order_relaxed)},
+        {"reconnects", reconnects.load(std::memory_order_relaxed)},
+        {"inFlight", inFlight.load(std::memory_order_relaxed)},
+        {"queueDepth", queueDepth.load(std::memory_order_relaxed)},
+        {"latency", QVariantMap
+            {
+                {"histogram", histogram},
+                {"p50", QXfsStatistics::percentile(histogram, 0.50)},
+                {"p90", QXfsStatistics::percentile(histogram, 0.90)},
+                {"p99", QXfsStatistics::percentile(histogram, 0.99)},
+                {"max", QXfsStatistics::percentile(histogram, 1)}
+            }
+        },
+        {"stages", stagesToMap(stages, ticksPerNs)}
+    };
+    QVariantMap server;
+
+    for (int i = 0; i < QXfsStatistics::PhaseCount; i++)
+    {
+        const quint64 n = phases[i].count.load(std::memory_order_relaxed);
+        const quint64 ns = phases[i].ticks.load(std::memory_order_relaxed);
+
+        server.insert(phaseNames[i], QVariantMap
+        {
+            {"count", n},
+            {"totalNs", ns},
+            {"meanNs", n ? double(ns) / n : 0.0}
+        });
+    }
+
+    rv.insert("server", server);
+    rv.insert("payloadCache", QVariantMap
+    {
+        {"hits", payloadCacheHits.load(std::memory_order_relaxed)},
+        {"misses", payloadCacheMisses.load(std::memory_order_relaxed)},
+        {"bytesSaved", payloadBytesSaved.load(std::memory_order_relaxed)}
+    });
+
+    if (QXfsStatistics::allocationAccounting())
+    {
+        const double frames[] =
+        {
+            double(framesIn.load(std::memory_order_relaxed)),
+            double(framesIn.load(std::memory_order_relaxed)),
+            double(framesOut.load(std::memory_order_relaxed))
+        };
+        QVariantMap paths;
+
+        for (int i = 0; i < QXfsStatistics::AllocationPathCount; i++)
+        {
+            const quint64 n = allocations[i].count.load(
+                        std::memory_order_relaxed);
+            const quint64 bytes = allocations[i].bytes.load(
+                        std::memory_order_relaxed);
+
+            paths.insert(allocationPathNames[i], QVariantMap
+            {
+                {"count", n},
+                {"bytes", bytes},
+                {"perFrame", QVariantMap
+                    {
+                        {"count", frames[i] ? n / frames[i] : 0.0},
+                        {"bytes", frames[i] ? bytes / frames[i] : 0.0}
+                    }
+                }
+            });
+        }
+
+        rv.insert("allocations", paths);
+    }
+
+    return rv;
+}
+
+QSharedPointer<QXfsDeviceStatistics>
+QXfsDeviceStatistics::device(const QString &deviceId)
+{
+    static bool autoListen = true;
+    QSharedPointer<QXfsDeviceStatistics> rv;
+    QString name;
+
+    {
+        QMutexLocker lock(devicesMutex);
+        QWeakPointer<QXfsDeviceStatistics> &entry = (*devices)[deviceId];
+
+        rv = entry.toStrongRef();
+
+        if (!rv)
+        {
+            rv.reset(new QXfsDeviceStatistics);
+            entry = rv;
+        }
+
+        if (autoListen)
+        {
+            autoListen = false;
+            name = QString::fromLocal8Bit(qgetenv("QXFS_STATS"));
+        }
+    }
+
+    if (name == "1")
+        QXfsStatistics::listen();
+    else if (!name.isEmpty())
+        QXfsStatistics::listen(name);
+
+    return rv;
+}
+
+qint64
+QXfsDeviceStatistics::now()
+{
+    return QXfsClock::instance()->nsecsElapsed();
+}
+
+qint64
+QXfsDeviceStatistics::systemNow()
+{
+    return monotonicClock->timer.nsecsElapsed();
+}
+
+QVariantMap
+QXfsStatistics::snapshot()
+{
+    QList<QPair<QString, QSharedPointer<QXfsDeviceStatistics>>> entries;
+    const double rate = ticksPerNs();
+    QVariantMap devs;
+
+    {
+        QMutexLocker lock(devicesMutex);
+        QXfsDeviceStatisticsMap::iterator it = devices->begin();
+
+        while (it != devices->end())
+        {
+            QSharedPointer<QXfsDeviceStatistics> stats = it->toStrongRef();
+
+            if (!stats)
+            {
+                it = devices->erase(it);
+                continue;
+            }
+
+            entries.append({it.key(), stats});
+            ++it;
+        }
+    }
+
+    for (int i = 0; i < entries.size(); i++)
+        devs.insert(entries[i].first, entries[i].second->toMap(rate));
+
+    return
+    {
+        {"timestamp", QXfsClock::instance()->msecsSinceEpoch()},
+        {"devices", devs},
+        {"stages", stagesToMap(processStages, rate)},
+        {"stageTimers", stageTimers()},
+        {"ticksPerNs", rate}
+    };
+}
+
+void
+QXfsStatistics::setStageTimers(bool enable)
+{
+    QXfsDeviceStatistics::stageTimers.store(enable,
+                                            std::memory_order_relaxed);
+}
+
+bool
+QXfsStatistics::stageTimers()
+{
+    return QXfsDeviceStatistics::timing();
+}
+
+bool
+QXfsStatistics::allocationAccounting()
+{
+#ifdef QXFS_ALLOCATION_ACCOUNTING
+    return true;
+#else
+    return false;
+#endif
+}
+
+qint64
+QXfsStatistics::percentile(const QVariantList &histogram, double p)
+{
+    quint64 total = 0;
+    quint64 seen = 0;
+
+    foreach (const QVariant &count, histogram)
+        total += count.toULongLong();
+
+    if (!total)
+        return 0;
+
+    const quint64 rank = qMax(quint64(p * total + 0.5), quint64(1));
+
+    for (int i = 0; i < histogram.size(); i++)
+    {
+        seen += histogram[i].toULongLong();
+
+        if (seen >= rank)
+            return Q_INT64_C(1) << (i + 1);
+    }
+
+    return Q_INT64_C(1) << histogram.size();
+}
+
+bool
+QXfsStatistics::listen(const QString &name)
+{
+    QMutexLocker lock(serverMutex);
+
+    if (QXfsStatisticsServer *server = statisticsServer)
+    {
+        return server->start(name.isEmpty()
+                             ? serverName(QCoreApplication::applicationPid())
+                             : name);
+    }
+
+    return false;
+}
+
+void
+QXfsStatistics::close()
+{
+    QMutexLocker lock(serverMutex);
+
+    if (QXfsStatisticsServer *server = statisticsServer)
+        server->stop();
+}
+
+QString
+QXfsStatistics::serverName(qint64 pid)
+{
+    return "qxfs-stats-" + QString::number(pid);
+}
@@ -0,0 +1,154 @@
+#ifndef QXFSSTATISTICS_H
+#define QXFSSTATISTICS_H
+
+#include <QVariantMap>
+
+#include "qxfs_global.h"
+
+/**
+ * @class QXfsStatistics
+ * @brief Live traffic statistics of the devices used by the process.
+ *
+ * @details
+ * Every connection keeps cheap atomic counters per device: frames in and
+ * out, commands in flight, frames queued for dispatch, a histogram of
+ * request latencies, disconnects and reconnects. snapshot() collects them
+ * from any thread.
+ *
+ * listen() exposes the snapshots on a local socket served by a thread of
+ * its own, so an inspector such as qxfs-top can attach to a running
+ * process; setting QXFS_STATS in the environment ("1" for the default
+ * name, or a server name) starts it along with the first connection.
+ *
+ * Stage timers break the time spent on the I/O thread down into the
+ * stages of the inbound path; they read the CPU cycle counter where there
+ * is one and cost a single relaxed load per stage while switched off.
+ *
+ * Builds configured with CONFIG+=qxfs_allocation_accounting also count
+ * the heap allocations (number and bytes) made through operator new on
+ * the decode, dispatch and send paths of each device. Adding
+ * CONFIG+=qxfs_malloc_hooks counts them at malloc() instead, whoever makes
+ * them: Qt containers, user slots, the library itself; that replaces the
+ * allocator entry points of the whole process, and needs glibc.
+ *
+ * Allocations are counted per device rather than per proxy: a frame is
+ * decoded before its msgid tells whose it is, and events are dispatched
+ * to every proxy of the device, so only the send path could be charged to
+ * a single proxy. The proxies of a device share its connection and thus
+ * its paths.
+ */
+class QXFS_EXPORT QXfsStatistics
+{
+public:
+    /**
+     * @brief Number of latency histogram buckets; bucket i counts requests
+     *        that took less than 2^(i+1) microseconds (and, but for the
+     *        first, at least 2^i).
+     */
+    static const int latencyBuckets = 32;
+
+    /**
+     * @brief Stages of the inbound path timed by the stage timers.
+     */
+    enum Stage
+    {
+        DecodeStage,    /**< Deserializing a frame off the transport. */
+        QueueStage,     /**< Waiting for the deferred dispatch. */
+        DispatchStage,  /**< Looking up and routing to the proxies. */
+        HandlerStage,   /**< Proxy signals, user slots and handlers. */
+        StageCount
+    };
+
+    /**
+     * @brief Paths heap allocations are attributed to.
+     */
+    enum AllocationPath
+    {
+        DecodeAllocations,      /**< Cutting and deserializing frames. */
+        DispatchAllocations,    /**< Queueing, routing and handling them. */
+        SendAllocations,        /**< Building and writing requests. */
+        AllocationPathCount
+    };
+
+    /**
+     * @brief Phases of a request told apart by the timing fields of
+     *        servers that negotiated them, see QXfsStream::features().
+     */
+    enum Phase
+    {
+        UplinkPhase,        /**< Issued until received by the server. */
+        ServerQueuePhase,   /**< Waiting in the server for the device. */
+        DevicePhase,        /**< Carried out by the device. */
+        DownlinkPhase,      /**< Finished until dispatched here. */
+        PhaseCount
+    };
+
+    /**
+     * @brief Returns the statistics of all devices in use.
+     *
+     * The map carries "timestamp" (ms since epoch, on QXfsClock) and
+     * "devices", mapping device ids to maps with the cumulative counters
+     * "framesIn", "framesOut", "completed", "disconnects" and "reconnects",
+     * the gauges "inFlight" and "queueDepth", and "latency" holding the raw
+     * "histogram" (list of bucket counts) and its "p50", "p90", "p99" and
+     * "max" in microseconds.
+     *
+     * "stages" maps stage names ("decode", "queue", "dispatch",
+     * "handler") to their "count", total "ticks" and mean duration
+     * "meanNs", per device and, at top level, for the whole process;
+     * "ticksPerNs" tells the rate of the tick counter and "stageTimers"
+     * whether the timers are on.
+     *
+     * With allocation accounting, every device also carries "allocations",
+     * mapping path names ("decode", "dispatch", "send") to their "count",
+     * "bytes" and "perFrame" averages (per inbound frame for decode and
+     * dispatch, per outbound one for send).
+     *
+     * "server" maps phase names ("uplink", "queue", "device", "downlink")
+     * to the "count", "totalNs" and "meanNs" of the replies that carried
+     * server timing fields. "payloadCache" holds the "hits" (fields sent
+     * as content hashes), "misses" and "bytesSaved" of the payload cache.
+     */
+    static QVariantMap snapshot();
+
+    /**
+     * @brief Switches the stage timers on or off, at runtime.
+     */
+    static void setStageTimers(bool enable);
+    static bool stageTimers();
+
+    /**
+     * @brief True if the library was built with allocation accounting.
+     */
+    static bool allocationAccounting();
+
+    /**
+     * @brief Upper bound, in microseconds, of the @p p quantile (0..1) of
+     *        a latency histogram as found in snapshot(); 0 if empty.
+     */
+    static qint64 percentile(const QVariantList &histogram, double p);
+
+    /**
+     * @brief Serves snapshots on local socket @p name, by default
+     *        serverName() of this process.
+     *
+     * Clients write a line "snapshot" and receive the snapshot as one line
+     * of compact JSON; the lines "stages on" and "stages off" switch the
+     * stage timers.
+     *
+     * @return bool False if the name could not be taken.
+     */
+    static bool listen(const QString &name = QString());
+
+    /**
+     * @brief Stops serving snapshots.
+     */
+    static void close();
+
+    /**
+     * @brief Default server name of process @p pid, i.e. "qxfs-stats-<pid>".
+     */
+    static QString serverName(qint64 pid);
+};
+
+#endif // QXFSSTATISTICS_H
@@ -0,0 +1,225 @@
+#ifndef QXFSSTATISTICS_P_H
+#define QXFSSTATISTICS_P_H
+
+#include <QSharedPointer>
+#include <QVariantMap>
+
+#include <atomic>
+
+#if defined(Q_PROCESSOR_X86) && (defined(Q_CC_GNU) || defined(Q_CC_MSVC))
+#  if defined(Q_CC_MSVC)
+#    include <intrin.h>
+#  else
+#    include <x86intrin.h>
+#  endif
+#  define QXFS_HAVE_RDTSC
+#endif
+
+#include "qxfsstatistics.h"
+
+/**
+ * @brief Number and total duration of the runs of one stage.
+ */
+struct QXfsStageCounter
+{
+    std::atomic<quint64> count;
+    std::atomic<quint64> ticks;
+
+    void add(quint64 duration)
+    {
+        count.fetch_add(1, std::memory_order_relaxed);
+        ticks.fetch_add(duration, std::memory_order_relaxed);
+    }
+
+    QVariantMap toMap(double ticksPerNs) const;
+};
+
+/**
+ * @brief Number and total size of the allocations made on one path.
+ */
+struct QXfsAllocationCounter
+{
+    std::atomic<quint64> count;
+    std::atomic<quint64> bytes;
+
+    void add(size_t size)
+    {
+        count.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * @brief Counters of one device, shared by all of its connections.
+ *
+ * Updated with relaxed atomics from the I/O threads; gauges are kept as
+ * deltas so connections of the same device on several threads add up.
+ */
+struct QXfsDeviceStatistics
+{
+    QXfsDeviceStatistics();
+
+    std::atomic<quint64> framesIn;
+    std::atomic<quint64> framesOut;
+    std::atomic<quint64> completed;
+    std::atomic<quint64> disconnects;
+    std::atomic<quint64> reconnects;
+    std::atomic<qint64> inFlight;
+    std::atomic<qint64> queueDepth;
+
+    /**
+     * @brief Payload cache fields sent as hashes, cache misses answered,
+     *        and the bytes the hashes stood for.
+     */
+    std::atomic<quint64> payloadCacheHits;
+    std::atomic<quint64> payloadCacheMisses;
+    std::atomic<quint64> payloadBytesSaved;
+    std::atomic<quint64> latency[QXfsStatistics::latencyBuckets];
+    QXfsStageCounter stages[QXfsStatistics::StageCount];
+    QXfsAllocationCounter allocations[QXfsStatistics::AllocationPathCount];
+
+    /**
+     * @brief Phase durations in nanoseconds, counted like stages.
+     */
+    QXfsStageCounter phases[QXfsStatistics::PhaseCount];
+
+    /**
+     * @brief Counts a completed request that took @p ns nanoseconds.
+     */
+    void recordLatency(qint64 ns);
+
+    QVariantMap toMap(double ticksPerNs) const;
+
+    /**
+     * @brief Returns the counters of @p deviceId, registering them while
+     *        somebody holds a reference.
+     */
+    static QSharedPointer<QXfsDeviceStatistics> device(
+            const QString &deviceId);
+
+    /**
+     * @brief Clock of request latencies and server timings, in
+     *        nanoseconds; QXfsClock, so simulated runs measure virtual time.
+     */
+    static qint64 now();
+
+    /**
+     * @brief Monotonic clock of the system, in nanoseconds, which a
+     *        simulated QXfsClock leaves alone.
+     */
+    static qint64 systemNow();
+
+    /**
+     * @brief True while the stage timers are on.
+     */
+    static bool timing()
+    {
+        return stageTimers.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Stage timer clock: the CPU cycle counter where available,
+     *        systemNow() otherwise.
+     */
+    static quint64 ticks()
+    {
+#ifdef QXFS_HAVE_RDTSC
+        return __rdtsc();
+#else
+        return quint64(systemNow());
+#endif
+    }
+
+    /**
+     * @brief Counts a run of @p stage for this device and the process.
+     */
+    void recordStage(QXfsStatistics::Stage stage, quint64 duration);
+
+    /**
+     * @brief Counts @p ns nanoseconds spent in @p phase by a request.
+     */
+    void recordPhase(QXfsStatistics::Phase phase, qint64 ns)
+    {
+        phases[phase].add(quint64(qMax(ns, qint64(0))));
+    }
+
+    static std::atomic<bool> stageTimers;
+};
+
+/**
+ * @class QXfsStageTimer
+ * @brief Times the enclosing scope as one run of a stage, if the stage
+ *        timers are on.
+ */
+class QXfsStageTimer
+{
+public:
+    QXfsStageTimer(QXfsDeviceStatistics *statistics,
+                   QXfsStatistics::Stage stage) :
+        m_statistics(QXfsDeviceStatistics::timing() ? statistics : nullptr),
+        m_stage(stage),
+        m_start(m_statistics ? QXfsDeviceStatistics::ticks() : 0)
+    {
+    }
+
+    ~QXfsStageTimer()
+    {
+        if (m_statistics)
+        {
+            m_statistics->recordStage(m_stage,
+                                      QXfsDeviceStatistics::ticks() - m_start);
+        }
+    }
+
+    /**
+     * @brief Discards the run, e.g. when a frame turned out incomplete.
+     */
+    void cancel() {m_statistics = nullptr;}
+
+private:
+    QXfsDeviceStatistics *m_statistics;
+    QXfsStatistics::Stage m_stage;
+    quint64 m_start;
+};
+
+/**
+ * @class QXfsAllocationScope
+ * @brief Attributes the heap allocations of the calling thread to a path
+ *        of a device for the lifetime of the scope.
+ *
+ * Scopes nest; a request sent from a handler counts as send. Compiles to
+ * nothing without QXFS_ALLOCATION_ACCOUNTING.
+ */
+#ifdef QXFS_ALLOCATION_ACCOUNTING
+class QXfsAllocationScope
+{
+public:
+    QXfsAllocationScope(QXfsDeviceStatistics *statistics,
+                        QXfsStatistics::AllocationPath path) :
+        m_previous(current)
+    {
+        current = &statistics->allocations[path];
+    }
+
+    ~QXfsAllocationScope() {current = m_previous;}
+
+    /**
+     * @brief Counter of the innermost scope of the thread, if any.
+     */
+    static thread_local QXfsAllocationCounter *current;
+
+private:
+    QXfsAllocationCounter *m_previous;
+};
+#else
+class QXfsAllocationScope
+{
+public:
+    QXfsAllocationScope(QXfsDeviceStatistics *,
+                        QXfsStatistics::AllocationPath)
+    {
+    }
+};
+#endif
+
+#endif // QXFSSTATISTICS_P_H
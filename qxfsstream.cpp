@@ -1,189 +1,264 @@
 #include <QDataStream>
+#include <QEvent>
 #include <QEventLoop>
+#include <QHash>
 #include <QMutex>
-#include <QUuid>
+#include <QSemaphore>
 #include <QDebug>
 #include <QThread>
 
+#include "qxfsclock.h"
+#include "qxfsconnection_p.h"
+#include "qxfsjournal_p.h"
+#include "qxfslog.h"
+#include "qxfssnapshot_p.h"
+#include "qxfsstatistics_p.h"
 #include "qxfsstream.h"
 
 /**
  * @brief Global mutex protecting device capabilities map.
+ *
+ * Only taken when a proxy is constructed; capability reads go through the
+ * per-device snapshot without locking.
  */
 Q_GLOBAL_STATIC(QMutex, capabilitiesMutex)
 
-QMap<QString, QVariantMap> QXfsStream::m_capabilities;
-
 /**
- * @brief Global mutex protecting device list.
+ * @brief Cached capabilities of a device and the flags compiled from them.
  */
-Q_GLOBAL_STATIC(QMutex, deviceMutex)
+struct QXfsCachedCapabilities
+{
+    QVariantMap caps;
+    QXfsCapabilityFlags flags;
+};
+
+using QXfsCapabilitiesSnapshot = QXfsSnapshot<QXfsCachedCapabilities>;
 
 /**
- * @brief Global list of all QXfsStream instances.
+ * @typedef QXfsCapabilitiesMap
+ * @brief Map of capability snapshots, keyed by device id.
  */
-Q_GLOBAL_STATIC(QList<QXfsStream *>, devices)
+using QXfsCapabilitiesMap =
+        QHash<QString, QSharedPointer<QXfsCapabilitiesSnapshot>>;
+Q_GLOBAL_STATIC(QXfsCapabilitiesMap, capabilitiesCache)
 
-QXfsStream::QXfsStream(QIODevice *io,
-                       const QString &deviceId,
-                       const QString &strClass, QObject *parent) :
-    QObject{parent},
-    m_io(io),
-    m_strClass(strClass.toUpper())
+static QSharedPointer<QXfsCapabilitiesSnapshot>
+capabilitiesSnapshot(const QString &deviceId)
 {
-    Q_ASSERT(m_strClass.length() == 3);
-    Q_ASSERT(m_io);
+    QMutexLocker lock(capabilitiesMutex);
+    QSharedPointer<QXfsCapabilitiesSnapshot> &snapshot =
+            (*capabilitiesCache)[deviceId];
 
-    setObjectName(deviceId);
+    if (!snapshot)
+        snapshot.reset(new QXfsCapabilitiesSnapshot);
 
-    {
-        QMutexLocker lock(deviceMutex);
-        devices->append(this);
-    }
+    return snapshot;
+}
 
-    m_statusCategory = "WFS_INF_" + m_strClass + "_STATUS";
-    m_capabilitiesCategory = "WFS_INF_" + m_strClass + "_CAPABILITIES";
+/**
+ * @brief Per device class data shared by all proxies of that class.
+ */
+struct QXfsStreamClass
+{
+    QString strClass;
+    QString statusCategory;
+    QString capabilitiesCategory;
 
-    connect(this, &QXfsStream::message,
-    [this](QVariantMap msg)
-    {
-        QString message = msg["message"].toString();
+    /**
+     * @brief Events after which the capabilities are refreshed.
+     */
+    QStringList capabilitiesEvents;
+};
 
-        if (message == "WFS_SERVICE_EVENT")
-        {
-            serviceEvent(msg);
-            emit serviceEventRecieved(msg);
-        }
-        else if (message == "WFS_USER_EVENT")
-        {
-            userEvent(msg);
-            emit userEventRecieved(msg);
-        }
-        else if (message == "WFS_SYSTEM_EVENT")
-        {
-            QString dwCommand;
-            QVariant lpCmdData;
+/**
+ * @brief Global mutex protecting device class map.
+ */
+Q_GLOBAL_STATIC(QMutex, streamClassMutex)
 
-            {
-                const QPair<QString, QVariant> &cmd = currentCommand();
+/**
+ * @typedef QXfsStreamClassMap
+ * @brief Map of device class descriptors, keyed by class name.
+ *
+ * Descriptors are never released, so proxies can keep plain pointers.
+ */
+using QXfsStreamClassMap = QHash<QString, QXfsStreamClass *>;
+Q_GLOBAL_STATIC(QXfsStreamClassMap, streamClasses)
 
-                dwCommand = cmd.first;
-                lpCmdData = cmd.second;
-            }
+static const QXfsStreamClass *
+streamClass(const QString &strClass)
+{
+    QMutexLocker lock(streamClassMutex);
+    QXfsStreamClass *&cls = (*streamClasses)[strClass];
 
-            systemEvent(msg);
-            emit systemEventRecieved(msg, dwCommand, lpCmdData);
-        }
-    });
+    if (!cls)
+    {
+        cls = new QXfsStreamClass;
+        cls->strClass = strClass;
+        cls->statusCategory = "WFS_INF_" + strClass + "_STATUS";
+        cls->capabilitiesCategory = "WFS_INF_" + strClass + "_CAPABILITIES";
+        cls->capabilitiesEvents = QStringList
+        {
+            "WFS_SYSE_DEVICE_STATUS",
+            "WFS_SRVE_" + strClass + "_CAPABILITIESCHANGED"
+        };
+    }
 
-    connect(m_io, SIGNAL(readyRead()), SLOT(readyRead()));
+    return cls;
 }
 
-QXfsStream::~QXfsStream()
+/**
+ * @brief Returns the connection of the proxies of @p deviceId on @p io,
+ *        shared like those of QXfsSocketStream.
+ */
+static QSharedPointer<QXfsConnection>
+ioConnection(QIODevice *io, const QString &deviceId)
 {
+    QSharedPointer<QXfsConnection> connection = QXfsConnection::shared(
+                "io|" + deviceId,
+    [&]() -> QXfsConnection *
     {
-        QMutexLocker lock(deviceMutex);
-        devices->removeOne(this);
+        return new QXfsConnection(io, deviceId);
+    });
+
+    /* another transport for the device is another connection */
+    if (connection->io() != io)
+    {
+        connection.reset(new QXfsConnection(io, deviceId),
+                         &QObject::deleteLater);
     }
+
+    return connection;
 }
 
-void
-QXfsStream::readyRead()
+QXfsStream::QXfsStream(QIODevice *io,
+                       const QString &deviceId,
+                       const QString &strClass, QObject *parent) :
+    QXfsStream(ioConnection(io, deviceId), deviceId, strClass, parent)
 {
-    for (;;)
-    {
-        QVariantMap msg;
-        QDataStream ds(m_io);
+}
 
-        ds.setByteOrder(QDataStream::BigEndian);
-        ds.startTransaction();
-        ds >> msg;
+QXfsStream::QXfsStream(const QSharedPointer<QXfsConnection> &connection,
+                       const QString &deviceId,
+                       const QString &strClass, QObject *parent) :
+    QObject{parent},
+    m_connection(connection),
+    m_class(streamClass(strClass.toUpper())),
+    m_capabilities(capabilitiesSnapshot(deviceId)),
+    m_refreshingCapabilities(false),
+    m_refreshingStatus(false)
+{
+    Q_ASSERT(m_class->strClass.length() == 3);
+    Q_ASSERT(m_connection->io());
 
-        if (!ds.commitTransaction())
-            return;
+    setObjectName(deviceId);
 
-        /* delay signal emission until we re-enter the event loop, otherwise
-         * we may deadlock if someone calls a blocking function, like getInfo()
-         */
-        QMetaObject::invokeMethod(this, [this, msg]
-        {
-            emit message(msg);
-        }, Qt::QueuedConnection);
-    }
+    m_connection->attach(this);
 }
 
-/**
- * @typedef QJsCommandMap
- * @brief Map storing commands per device.
- *
- * Key: device object name.
- * Value: list of command pairs <dwCommand, lpCmdData>.
- */
-using QJsCommandMap = QMap<QString, QList<QPair<QString, QVariant>>>;
-Q_GLOBAL_STATIC(QJsCommandMap, commands);
-
-/**
- * @brief Mutex protecting command map.
- */
-Q_GLOBAL_STATIC(QMutex, commandMutex)
-
-QPair<QString, QVariant>
-QXfsStream::currentCommand() const
+QXfsStream::~QXfsStream()
 {
-    QMutexLocker lock(commandMutex);
+    const QMap<QString, QString> &requests = m_connection->pending(this, true);
+    QIODevice *io = m_connection->io();
 
-    if (!(*commands)[objectName()].isEmpty())
-        return (*commands)[objectName()].first();
+    m_connection->detach(this);
 
-    return {QString(), QVariant()};
+    /* spare the server commands nobody waits for; no reconnecting here,
+     * the subclass is gone already
+     */
+    if (!requests.isEmpty() && io && io->isOpen() &&
+        m_connection->thread() == QThread::currentThread())
+    {
+        foreach (const QString &requestId, requests.keys())
+            m_connection->cancel(requestId);
+    }
 }
 
 void
-QXfsStream::appendCommand(const QPair<QString, QVariant> &cmd) const
+QXfsStream::deliver(const QVariantMap &msg)
 {
-    QMutexLocker lock(commandMutex);
-
-    (*commands)[objectName()].append(cmd);
+    m_connection->dispatch(msg);
 }
 
-void
-QXfsStream::finishCommand() const
+bool
+QXfsStream::connectToServer(QIODevice *io)
 {
-    QMutexLocker lock(commandMutex);
+    Q_UNUSED(io);
 
-    if (!(*commands)[objectName()].isEmpty())
-        (*commands)[objectName()].removeFirst();
+    return m_connection->open();
 }
 
-QString
-QXfsStream::execute(const QString &dwCommand, const QVariant &lpCmdData)
+QMap<QString, QString>
+QXfsStream::pending() const
 {
-    QString msgid = send("WFSExecute", dwCommand, lpCmdData);
-
-    if (msgid.isEmpty())
-        return QString();
+    return m_connection->pending(this);
+}
 
-    QMetaObject::Connection *c = new QMetaObject::Connection;
+void
+QXfsStream::receive(const QVariantMap &msg)
+{
+    QString type = msg["message"].toString();
 
-    *c = connect(this, &QXfsStream::message, this,
-    [this, msgid, c, dwCommand, lpCmdData](QVariantMap msg)
+    if (type == "WFS_SERVICE_EVENT")
     {
-        if (msg["msgid"] != msgid)
-            return;
+        serviceEvent(msg);
+        emit serviceEventRecieved(msg);
+    }
+    else if (type == "WFS_USER_EVENT")
+    {
+        userEvent(msg);
+        emit userEventRecieved(msg);
+    }
+    else if (type == "WFS_SYSTEM_EVENT")
+    {
+        QString dwCommand;
+        QVariant lpCmdData;
 
+        /* system events keep their place among acks and completions, so
+         * the queue holds the command running when the event arrived
+         */
         {
-            QMutexLocker lock(deviceMutex);
+            const QPair<QString, QVariant> &cmd =
+                    m_connection->currentCommand();
 
-            foreach (QXfsStream *device, *devices)
-            {
-                if (device->objectName() == objectName())
-                {
-                    emit device->executeEventBroadcasted(
-                        msg, dwCommand, lpCmdData);
-                }
-            }
+            dwCommand = cmd.first;
+            lpCmdData = cmd.second;
         }
 
+        systemEvent(msg);
+        emit systemEventRecieved(msg, dwCommand, lpCmdData);
+    }
+
+    /* every proxy of the connection sees the event, the first one
+     * refreshes for all
+     */
+    if ((type == "WFS_SYSTEM_EVENT" || type == "WFS_SERVICE_EVENT") &&
+        m_class->capabilitiesEvents.contains(eventId(msg)) &&
+        m_connection->streams().value(0) == this)
+    {
+        refreshCapabilities();
+    }
+
+    if ((type == "WFS_SYSTEM_EVENT" || type == "WFS_SERVICE_EVENT") &&
+        m_connection->stateBoard() &&
+        m_connection->streams().value(0) == this)
+    {
+        refreshStatus();
+    }
+
+    emit message(msg);
+}
+
+QString
+QXfsStream::execute(const QString &dwCommand, const QVariant &lpCmdData)
+{
+    return send("WFSExecute", dwCommand, lpCmdData,
+    [this, dwCommand, lpCmdData](QVariantMap msg)
+    {
+        const QString msgid = msg["msgid"].toString();
+
+        foreach (QXfsStream *device, m_connection->streams())
+            emit device->executeEventBroadcasted(msg, dwCommand, lpCmdData);
+
         if (msg["hResult"] == "WFS_SUCCESS")
         {
             if (msg.contains("message"))
@@ -194,8 +269,6 @@ QXfsStream::execute(const QString &dwCommand, const QVariant &lpCmdData)
                 {
                     Q_ASSERT(dwCommand == msg["dwCommandCode"]);
                     done(msgid);
-                    disconnect(*c);
-                    delete c;
                     emit executeComplete(msg);
                 }
                 else if (message == "WFS_EXECUTE_EVENT")
@@ -204,68 +277,79 @@ QXfsStream::execute(const QString &dwCommand, const QVariant &lpCmdData)
             else
             {
                 Q_ASSERT(dwCommand == msg["dwCommandCode"]);
-                appendCommand({dwCommand, lpCmdData});
+                m_connection->appendCommand(msgid, {dwCommand, lpCmdData});
             }
         }
         else
         {
             done(msgid);
-            disconnect(*c);
-            delete c;
             emit executeComplete(msg);
         }
     });
-
-    return msgid;
 }
 
 QVariantMap
 QXfsStream::syncExecute(const QString &cmd, const QVariant &cmdData)
 {
     QVariantMap rv;
-    QEventLoop loop;
     QString msgid;
-    QMetaObject::Connection c = connect(this, &QXfsStream::executeComplete,
-                                        [&](const QVariantMap &msg)
+    QMetaObject::Connection c;
+
+    await([&](const Wake &wake)
     {
-        if (msg["msgid"] != msgid)
-            return;
+        c = connect(this, &QXfsStream::executeComplete,
+                    [&, wake](const QVariantMap &msg)
+        {
+            if (msg["msgid"] != msgid)
+                return;
 
-        const auto &hResult = msg["hResult"];
+            const auto &hResult = msg["hResult"];
 
-        loop.exit();
-        rv = msg;
+            QObject::disconnect(c);
+            rv = msg;
 
-        if (hResult != "WFS_SUCCESS")
-        {
-            qWarning() << objectName() << " - " << cmd
-                       << "command failed with " << hResult.toString();
-        }
-    });
+            if (hResult != "WFS_SUCCESS")
+            {
+                const QString device = objectName();
+
+                QXfsLog::warning("execute/" + device + "/" + cmd,
+                                 [device, cmd, hResult](QString &text,
+                                                        QVariantMap &fields)
+                {
+                    text = QString("%1 - %2 command failed with %3")
+                           .arg(device, cmd, hResult.toString());
+                    fields = {{"device", device},
+                              {"command", cmd},
+                              {"hResult", hResult}};
+                });
+            }
+
+            wake();
+        });
 
-    msgid = execute(cmd, cmdData);
+        msgid = execute(cmd, cmdData);
 
-    if (!msgid.isEmpty())
-        loop.exec();
+        if (msgid.isEmpty())
+            QObject::disconnect(c);
 
-    QObject::disconnect(c);
+        return !msgid.isEmpty();
+    });
 
     return rv;
 }
 
 QString
 QXfsStream::send(const QString &function, const QString &dwCommand,
-                    const QVariant &lpCmdData)
+                 const QVariant &lpCmdData,
+                 const std::function<void(const QVariantMap &)> &handler)
 {
-    Q_ASSERT(m_io->thread() == QThread::currentThread());
-
-    if (!connectToServer(m_io))
+    if (!connectToServer(m_connection->io()))
         return QString();
 
-    QDataStream ds(m_io);
-    ds.setByteOrder(QDataStream::BigEndian);
-
-    QString msgid = QUuid::createUuid().toString();
+    QXfsAllocationScope scope(m_connection->statistics(),
+                              QXfsStatistics::SendAllocations);
+    QString msgid = m_connection->createMsgId();
+    QString key;
     QVariantMap cmd
     {
         {"dwCommand", dwCommand},
@@ -273,9 +357,54 @@ QXfsStream::send(const QString &function, const QString &dwCommand,
         {"lpCmdData", lpCmdData.toMap()},
         {"msgid", msgid}
     };
-    ds << cmd;
 
-    m_pending[msgid] = dwCommand;
+    QVariantMap wire;
+    std::function<void(const QVariantMap &)> finalize = handler;
+
+    /* executes may change device state, so only they are worth a key */
+    if (function == "WFSExecute")
+        key = m_connection->createIdempotencyKey();
+
+    if (!key.isEmpty())
+        cmd.insert("idempotencyKey", key);
+
+    wire = cmd;
+
+    /* a server that lost a payload is sent the fields it misses in full,
+     * under the same msgid; the connection hands the miss to this wrapper
+     * only, so neither the handler nor the signals see it
+     */
+    if (m_connection->cachePayloads(wire))
+    {
+        finalize = [this, cmd, handler](const QVariantMap &msg)
+        {
+            if (!m_connection->payloadsMissed(msg))
+            {
+                handler(msg);
+                return;
+            }
+
+            QVariantMap retry = cmd;
+
+            m_connection->cachePayloads(retry);
+            m_connection->write(retry);
+        };
+    }
+
+    /* journaled before it can reach the device; a command the journal
+     * could not take is not sent, it would be lost to a crash
+     */
+    if (m_journal && function == "WFSExecute" &&
+        !m_journal->sent(msgid, dwCommand))
+    {
+        return QString();
+    }
+
+    m_connection->addPending(msgid, this, dwCommand, finalize,
+                             key.isEmpty() ? QVariantMap() : cmd,
+                             function == "WFSExecute");
+
+    m_connection->write(wire);
 
     return msgid;
 }
@@ -283,27 +412,21 @@ QXfsStream::send(const QString &function, const QString &dwCommand,
 void
 QXfsStream::done(const QString &msgid)
 {
-    finishCommand();
-    m_pending.remove(msgid);
+    m_connection->finishCommand(msgid);
+    m_connection->removePending(msgid);
+
+    if (m_journal)
+        m_journal->completed(msgid);
 }
 
-QVariantMap
-QXfsStream::getInfo(const QString &category, const QVariant &queryDetails)
+QString
+QXfsStream::asyncGetInfo(
+        const QString &category, const QVariant &queryDetails,
+        const std::function<void(const QVariantMap &)> &handler)
 {
-    QVariantMap rv;
-    QString msgid = send("WFSGetInfo", category, queryDetails);
-
-    if (msgid.isEmpty())
-        return rv;
-
-    QEventLoop loop;
-
-    QMetaObject::Connection c = connect(this, &QXfsStream::message, this,
-    [&](QVariantMap msg)
+    return send("WFSGetInfo", category, queryDetails,
+    [this, category, handler](QVariantMap msg)
     {
-        if (msg["msgid"] != msgid)
-            return;
-
         const QString &hResult = msg["hResult"].toString();
 
         if (hResult == "WFS_SUCCESS")
@@ -316,17 +439,41 @@ QXfsStream::getInfo(const QString &category, const QVariant &queryDetails)
         }
         else
         {
-            qWarning() << objectName() << " - " << category
-                   << " command failed with " << hResult;
+            const QString device = objectName();
+
+            QXfsLog::warning("getinfo/" + device + "/" + category,
+                             [device, category, hResult](QString &text,
+                                                         QVariantMap &fields)
+            {
+                text = QString("%1 - %2 command failed with %3")
+                       .arg(device, category, hResult);
+                fields = {{"device", device},
+                          {"category", category},
+                          {"hResult", hResult}};
+            });
         }
 
-        done(msgid);
-        rv = msg;
-        loop.exit(0);
+        done(msg["msgid"].toString());
+        handler(msg);
     });
+}
+
+QVariantMap
+QXfsStream::getInfo(const QString &category, const QVariant &queryDetails)
+{
+    QVariantMap rv;
 
-    loop.exec();
-    disconnect(c);
+    await([&](const Wake &wake)
+    {
+        QString msgid = asyncGetInfo(category, queryDetails,
+        [&, wake](const QVariantMap &msg)
+        {
+            rv = msg;
+            wake();
+        });
+
+        return !msgid.isEmpty();
+    });
 
     return rv;
 }
@@ -334,29 +481,20 @@ QXfsStream::getInfo(const QString &category, const QVariant &queryDetails)
 QString
 QXfsStream::cancel(const QString &reqMsgId)
 {
-    if (!connectToServer(m_io))
+    if (!connectToServer(m_connection->io()))
         return QString();
 
-    QString msgid = QUuid::createUuid().toString();
-    QMetaObject::Connection *c = new QMetaObject::Connection;
+    QXfsAllocationScope scope(m_connection->statistics(),
+                              QXfsStatistics::SendAllocations);
+    QString msgid = m_connection->createMsgId();
 
-    *c = connect(this, &QXfsStream::message,
-    [this, msgid, c](QVariantMap msg)
+    m_connection->addPending(msgid, this, QString(),
+    [this, msgid](QVariantMap msg)
     {
-        if (msg["msgid"] != msgid)
-            return;
-
         done(msgid);
-        disconnect(*c);
-        delete c;
         emit cancelComplete(msg);
     });
 
-    m_pending[msgid] = "";
-
-    QDataStream ds(m_io);
-    ds.setByteOrder(QDataStream::BigEndian);
-
     QVariantMap cmd
     {
         {"function", "WFSCancel"},
@@ -366,7 +504,7 @@ QXfsStream::cancel(const QString &reqMsgId)
     if (!reqMsgId.isEmpty() )
         cmd.insert("RequestID", reqMsgId);
 
-    ds << cmd;
+    m_connection->write(cmd);
 
     return msgid;
 }
@@ -374,70 +512,418 @@ QXfsStream::cancel(const QString &reqMsgId)
 bool
 QXfsStream::syncCancel(const QString &reqMsgId)
 {
-    QString msgid = cancel(reqMsgId);
+    QString msgid;
+    QMetaObject::Connection c1;
+    QMetaObject::Connection c2;
+    bool finish;
 
-    if (msgid.isEmpty())
-        return false;
+    await([&](const Wake &wake)
+    {
+        msgid = cancel(reqMsgId);
 
-    QEventLoop loop;
-    bool finish = reqMsgId.isEmpty();
+        if (msgid.isEmpty())
+            return false;
 
-    QMetaObject::Connection c1 = connect(this, &QXfsStream::cancelComplete,
-    [&](QVariantMap msg)
-    {
-        if (msg["msgid"] != msgid)
-            return;
+        finish = reqMsgId.isEmpty();
 
-        disconnect(c1);
+        /* whichever of the two completions comes last wakes the caller */
+        c1 = connect(this, &QXfsStream::cancelComplete,
+        [&, wake](QVariantMap msg)
+        {
+            if (msg["msgid"] != msgid)
+                return;
 
-        if (finish || msg["hResult"] != "WFS_SUCCESS")
-            loop.exit();
-        else
-            finish = true;
+            disconnect(c1);
+
+            if (finish || msg["hResult"] != "WFS_SUCCESS")
+            {
+                disconnect(c2);
+                wake();
+            }
+            else
+                finish = true;
+        });
+
+        c2 = connect(this, &QXfsStream::executeComplete,
+        [&, wake](QVariantMap msg)
+        {
+            if (msg["msgid"] != reqMsgId)
+                return;
+
+            disconnect(c2);
+
+            if (finish)
+                wake();
+            else
+                finish = true;
+        });
+
+        return true;
     });
 
-    QMetaObject::Connection c2 = connect(this, &QXfsStream::executeComplete,
-    [&, reqMsgId](QVariantMap msg)
+    return !msgid.isEmpty();
+}
+
+void
+QXfsStream::await(const std::function<bool(const Wake &)> &start)
+{
+    if (thread() == QThread::currentThread())
     {
-        if (msg["msgid"] != reqMsgId)
-            return;
+        QEventLoop loop;
 
-        disconnect(c2);
+        if (start([&loop] {loop.exit();}))
+            loop.exec();
 
-        if (finish)
-            loop.exit();
-        else
-            finish = true;
+        return;
+    }
+
+    /* the request is issued and completed on the proxy's thread, which
+     * owns the transport; the caller merely sleeps until it is done
+     */
+    QSemaphore completed;
+
+    QMetaObject::invokeMethod(this, [&]
+    {
+        if (!start([&completed] {completed.release();}))
+            completed.release();
+    }, Qt::QueuedConnection);
+
+    completed.acquire();
+}
+
+bool
+QXfsStream::drain(int timeout, DrainPolicy policy)
+{
+    bool drained = false;
+
+    await([&](const Wake &wake)
+    {
+        QXfsTimer *timer = new QXfsTimer(this);
+
+        /* only executes can be cancelled, getInfo requests and cancels
+         * are awaited
+         */
+        if (policy == CancelPending)
+        {
+            const QMap<QString, QString> &requests =
+                    m_connection->pending(this, true);
+            QMap<QString, QString>::const_iterator it;
+
+            for (it = requests.cbegin(); it != requests.cend(); it++)
+                cancel(it.key());
+        }
+
+        m_connection->whenIdle(this, [&drained, timer, wake]
+        {
+            drained = true;
+            timer->stop();
+            timer->deleteLater();
+            wake();
+        });
+
+        timer->setSingleShot(true);
+        connect(timer, &QXfsTimer::timeout, this, [this, timer, wake]
+        {
+            const QMap<QString, QString> &requests = pending();
+            QMap<QString, QString>::const_iterator it;
+            QVariantMap msg = {{"hResult", "WFS_ERR_TIMEOUT"}};
+
+            m_connection->whenIdle(this, nullptr);
+            timer->deleteLater();
+
+            for (it = requests.cbegin(); it != requests.cend(); it++)
+            {
+                msg["msgid"] = it.key();
+                msg["dwCommandCode"] = it.value();
+
+                deliver(msg);
+            }
+
+            wake();
+        });
+
+        if (timeout >= 0)
+            timer->start(timeout);
+
+        return true;
     });
 
-    loop.exec();
+    return drained;
+}
+
+int
+QXfsStream::addDirectHandler(const QString &eventId,
+                             const DirectHandler &handler)
+{
+    return m_connection->addDirectHandler(this, eventId, handler);
+}
+
+void
+QXfsStream::removeDirectHandler(int id)
+{
+    m_connection->removeDirectHandler(this, id);
+}
+
+bool
+QXfsStream::setJournal(const QString &fileName)
+{
+    QScopedPointer<QXfsJournal> journal;
+
+    if (!fileName.isEmpty())
+    {
+        journal.reset(new QXfsJournal(fileName));
+
+        if (!journal->open())
+            return false;
+    }
+
+    m_journal.reset(journal.take());
+
+    return true;
+}
+
+bool
+QXfsStream::setStateBoard(bool enable)
+{
+    QScopedPointer<QXfsStateBoard> board;
+
+    if (enable && m_connection->stateBoard())
+        return true;
+
+    if (enable)
+    {
+        board.reset(new QXfsStateBoard(objectName()));
+
+        if (!board->create())
+            return false;
+    }
+
+    m_connection->setStateBoard(board.take());
+
+    if (!enable)
+        return true;
+
+    const QVariantMap &caps = m_capabilities->load().caps;
+
+    if (caps.isEmpty())
+        refreshCapabilities();
+    else
+        m_connection->stateBoard()->publish(
+                    QXfsStateBoard::CapabilitiesEntry, caps);
+
+    refreshStatus();
 
     return true;
 }
 
+QMap<QString, QString>
+QXfsStream::interruptedCommands() const
+{
+    return m_journal ? m_journal->interrupted() : QMap<QString, QString>();
+}
+
+void
+QXfsStream::clearInterruptedCommands()
+{
+    if (m_journal)
+        m_journal->clearInterrupted();
+}
+
+void
+QXfsStream::setFraming(Framing framing)
+{
+    m_connection->setFraming(framing);
+}
+
+QVariantMap
+QXfsStream::features() const
+{
+    return m_connection->features();
+}
+
+void
+QXfsStream::setNegotiationTimeout(int ms)
+{
+    m_connection->setNegotiationTimeout(ms);
+}
+
+void
+QXfsStream::setParallelDecoding(bool enable)
+{
+    m_connection->setParallelDecoding(enable);
+}
+
+bool
+QXfsStream::migrate(QThread *thread)
+{
+    bool rv = false;
+
+    if (this->thread() != QThread::currentThread())
+    {
+        QMetaObject::invokeMethod(this, [&] {rv = migrate(thread);},
+                                  Qt::BlockingQueuedConnection);
+        return rv;
+    }
+
+    if (thread == this->thread())
+        return true;
+
+    rv = m_connection->migrate(thread);
+
+    if (!rv)
+    {
+        QXfsLog::warning("migrate/" + objectName(),
+                         objectName() + " - unable to migrate, a proxy or "
+                         "the transport is owned by another object");
+    }
+
+    return rv;
+}
+
+bool
+QXfsStream::event(QEvent *e)
+{
+    if (e->type() == QEvent::ThreadChange && !m_connection->isMigrating())
+    {
+        QXfsLog::warning("migrate/" + objectName(),
+                         objectName() + " - moved without its connection, "
+                         "use QXfsStream::migrate()");
+    }
+
+    return QObject::event(e);
+}
+
 QVariantMap
 QXfsStream::capabilities()
 {
-    QMutexLocker lock(capabilitiesMutex);
-    QVariantMap caps = m_capabilities[objectName()];
+    QVariantMap caps = m_capabilities->load().caps;
 
     if (caps.isEmpty())
+    {
+        getCapabilities();
+        caps = m_capabilities->load().caps;
+    }
+
+    return caps;
+}
+
+QXfsCapabilityFlags
+QXfsStream::capabilityFlags()
+{
+    QXfsCapabilityFlags flags = m_capabilities->load().flags;
+
+    if (!flags.isValid())
+    {
         getCapabilities();
+        flags = m_capabilities->load().flags;
+    }
 
-    return m_capabilities[objectName()];
+    return flags;
+}
+
+void
+QXfsStream::refreshCapabilities()
+{
+    if (m_refreshingCapabilities)
+        return;
+
+    m_refreshingCapabilities = true;
+
+    const QString &msgid = asyncGetInfo(m_class->capabilitiesCategory,
+                                        QVariant(),
+    [this](const QVariantMap &msg)
+    {
+        m_refreshingCapabilities = false;
+
+        if (msg["hResult"] != "WFS_SUCCESS" || !msg.contains("lpBuffer"))
+            return;
+
+        const QVariantMap &caps = msg["lpBuffer"].toMap();
+
+        m_capabilities->store({caps, QXfsCapabilityFlags::fromCapabilities(
+                                   m_class->strClass, caps)});
+
+        if (m_connection->stateBoard())
+        {
+            m_connection->stateBoard()->publish(
+                        QXfsStateBoard::CapabilitiesEntry, caps);
+        }
+
+        foreach (QXfsStream *device, m_connection->streams())
+            emit device->capabilitiesChanged(caps);
+    });
+
+    if (msgid.isEmpty())
+        m_refreshingCapabilities = false;
+}
+
+QString
+QXfsStream::eventId(const QVariantMap &msg)
+{
+    if (msg.contains("dwEventID"))
+        return msg["dwEventID"].toString();
+
+    return msg["dwCommandCode"].toString();
 }
 
 void
 QXfsStream::getCapabilities()
 {
-    QVariantMap data = getInfo(m_capabilitiesCategory);
+    QVariantMap data = getInfo(m_class->capabilitiesCategory);
 
     if (data.contains("lpBuffer"))
-        m_capabilities[objectName()] = data["lpBuffer"].toMap();
+    {
+        const QVariantMap &caps = data["lpBuffer"].toMap();
+
+        m_capabilities->store({caps, QXfsCapabilityFlags::fromCapabilities(
+                                   m_class->strClass, caps)});
+
+        if (m_connection->stateBoard())
+        {
+            m_connection->stateBoard()->publish(
+                        QXfsStateBoard::CapabilitiesEntry, caps);
+        }
+    }
 }
 
 QVariantMap
 QXfsStream::getStatus()
 {
-    return getInfo(m_statusCategory)["lpBuffer"].toMap();
+    const QVariantMap &status =
+            getInfo(m_class->statusCategory)["lpBuffer"].toMap();
+
+    if (!status.isEmpty() && m_connection->stateBoard())
+    {
+        m_connection->stateBoard()->publish(QXfsStateBoard::StatusEntry,
+                                            status);
+    }
+
+    return status;
+}
+
+void
+QXfsStream::refreshStatus()
+{
+    if (m_refreshingStatus || !m_connection->stateBoard())
+        return;
+
+    m_refreshingStatus = true;
+
+    const QString &msgid = asyncGetInfo(m_class->statusCategory, QVariant(),
+    [this](const QVariantMap &msg)
+    {
+        m_refreshingStatus = false;
+
+        if (msg["hResult"] != "WFS_SUCCESS" || !msg.contains("lpBuffer") ||
+            !m_connection->stateBoard())
+        {
+            return;
+        }
+
+        m_connection->stateBoard()->publish(QXfsStateBoard::StatusEntry,
+                                            msg["lpBuffer"].toMap());
+    });
+
+    if (msgid.isEmpty())
+        m_refreshingStatus = false;
 }
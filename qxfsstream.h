@@ -2,9 +2,20 @@
 #define QXFSSTREAM_H
 
 #include <QIODevice>
+#include <QScopedPointer>
+#include <QSharedPointer>
 #include <QVariantMap>
 
+#include <functional>
+
 #include "qxfs_global.h"
+#include "qxfscapabilityflags.h"
+
+class QXfsConnection;
+class QXfsJournal;
+struct QXfsStreamClass;
+struct QXfsCachedCapabilities;
+template <typename T> class QXfsSnapshot;
 
 /**
  * @class QNdcXfsStream
@@ -26,6 +37,31 @@ class QXFS_EXPORT QXfsStream : public QObject
     Q_OBJECT
 
 public:
+    /**
+     * @brief Wire framing of the QDataStream-serialized frames.
+     */
+    enum Framing
+    {
+        LegacyFraming,          /**< Frames back to back, no delimiter. */
+        LengthPrefixedFraming   /**< Each frame preceded by its quint32 size. */
+    };
+    Q_ENUM(Framing)
+
+    /**
+     * @brief What drain() does with the outstanding requests.
+     */
+    enum DrainPolicy
+    {
+        CancelPending,  /**< Cancel them all at once, then await them. */
+        AwaitPending    /**< Let them run to completion. */
+    };
+    Q_ENUM(DrainPolicy)
+
+    /**
+     * @brief Handler of directly dispatched events, see
+     *        addDirectHandler(); returns true to consume the event.
+     */
+    using DirectHandler = std::function<bool(const QVariantMap &)>;
 
     /**
      * @brief Constructs a device proxy bound to a device class id.
@@ -34,6 +70,10 @@ public:
      * @param deviceId Logical identifier of the target device instance.
      * @param strClass Device class discriminator used by the backend.
      *
+     * Proxies of @p deviceId on the same @p io and thread share one
+     * connection, and with it the device-wide command queue and the
+     * broadcast of execute events.
+     *
      * @note Construction does not guarantee immediate connectivity. The
      *       connectToServer() slot is used to establish a session.
      */
@@ -43,7 +83,11 @@ public:
     /**
      * @brief Destroys the device proxy and releases resources.
      *
-     * Ensures pending operations are finalized and the io device is closed.
+     * Outstanding executes are cancelled on the server without waiting
+     * for them, and the dispatch state of all requests is released; their
+     * handlers and completion signals never run. Call drain() first to
+     * have them finalized. The transport is shared and stays open for
+     * other proxies of the device.
      */
     ~QXfsStream();
 
@@ -67,7 +111,12 @@ public:
     /**
      * @brief Synchronously executes a device command.
      *
-     * Same as execute(), but runs local event loop until command finishes.
+     * Same as execute(), but blocks until the command finishes.
+     *
+     * On the proxy's own thread a local event loop is run; other threads
+     * (e.g. workers in an I/O thread deployment) sleep without an event loop
+     * while the proxy's thread, which must not be blocked itself, issues
+     * and completes the request.
      */
     Q_INVOKABLE QVariantMap syncExecute(
             const QString &cmd, const QVariant &cmdData = QVariant());
@@ -88,7 +137,8 @@ public:
      * @brief Synchronously cancels a previously issued command.
      *
      * Blocks execution until cancelComplete or executeComplete events
-     * are received for the specified message.
+     * are received for the specified message; see syncExecute() regarding
+     * the calling thread.
      *
      * @param reqMsgId Request id returned by execute(). If empty, the
      *        implementation may target the current command.
@@ -96,6 +146,192 @@ public:
      */
     Q_INVOKABLE bool syncCancel(const QString &reqMsgId = QString());
 
+    /**
+     * @brief Queries information like getInfo(), without blocking.
+     *
+     * Must be called from the proxy's thread.
+     *
+     * @param handler Called with the completion, or a failure frame.
+     * @return QString Request message id, empty if nothing was sent.
+     */
+    QString asyncGetInfo(
+            const QString &category, const QVariant &queryDetails,
+            const std::function<void(const QVariantMap &)> &handler);
+
+    /**
+     * @brief Retrieves device capabilities compiled into feature flags.
+     *
+     * @return QXfsCapabilityFlags Flags testable in constant time.
+     *
+     * Built once per capabilities refresh, together with the cached
+     * capabilities(); fetches them from the device if not cached.
+     */
+    QXfsCapabilityFlags capabilityFlags();
+
+    /**
+     * @brief Returns the event id of an event frame, carried where
+     *        completions carry their command code, as in the WFSRESULT
+     *        union.
+     */
+    static QString eventId(const QVariantMap &msg);
+
+    /**
+     * @brief Selects the wire framing; must match the device server.
+     *
+     * Applies to the connection, i.e. to all proxies of the device. Used
+     * for the protocol negotiation and with servers that do not negotiate.
+     */
+    void setFraming(Framing framing);
+
+    /**
+     * @brief Returns the protocol features in effect on the connection.
+     *
+     * @return QVariantMap "codec", "byteOrder" ("big", "little"), "framing"
+     *         ("legacy", "length"), "compression" ("none", "zlib"),
+     *         "idFormat" ("uuid", "counter"), "multiplexing",
+     *         "idempotency", "timing", "payloadCache", the protocol
+     *         "version" and "negotiated", false while the legacy protocol
+     *         is in use.
+     *
+     * Socket streams negotiate the features with the server on every
+     * (re)connection, offering all of the above but multiplexing; servers
+     * that do not answer the hello keep the legacy protocol.
+     *
+     * With idempotency, execute frames carry an "idempotencyKey". Pending
+     * executes survive a lost connection: once reconnected, one batched
+     * WFSQueryCompletion asks the server about their keys, completions it
+     * kept are delivered, commands it never received are sent again under
+     * the same key and running ones continue. Only if that fails do they
+     * complete with WFS_ERR_CONNECTION_LOST.
+     *
+     * With timing, replies may carry a "timing" map with the server's
+     * monotonic "received", "started" and "finished" readings (ns). The
+     * hello doubles as clock sync, "clockOffsetNs" and "clockErrorNs"
+     * telling its outcome; the frames handed out are completed with
+     * "uplinkNs", "queueNs", "deviceNs" and "downlinkNs" and the phases
+     * are aggregated in QXfsStatistics. The offset is measured again on
+     * every reconnection only, so clock drift adds to the uplink and
+     * downlink over long-lived connections.
+     *
+     * With payloadCache, lpCmdData strings and byte arrays of 4 KiB and
+     * more (forms, media, logos, key material) are sent once with their
+     * SHA-256 in "cacheKeys" and later only listed by hash in
+     * "cachedFields". A server that no longer holds one answers
+     * WFS_ERR_CACHE_MISS with the "missing" hashes, and the command is sent
+     * again with those fields in full, transparently.
+     */
+    QVariantMap features() const;
+
+    /**
+     * @brief Sets how long the server has to answer the protocol
+     *        negotiation, 0 to skip it; 1000 ms by default.
+     *
+     * Connecting does not wait for the answer: requests issued meanwhile
+     * are held back and sent once the protocol is settled. The timeout
+     * runs on QXfsClock.
+     */
+    void setNegotiationTimeout(int ms);
+
+    /**
+     * @brief Enables decoding of inbound frames on a worker thread pool.
+     *
+     * Effective with LengthPrefixedFraming only, where frames can be cut
+     * without decoding them. Frames are dispatched in their original order,
+     * so event semantics are unchanged; large payloads (journals, scanned
+     * images) are decoded off the owning thread and across cores.
+     */
+    void setParallelDecoding(bool enable);
+
+    /**
+     * @brief Moves this proxy to @p thread together with its connection,
+     *        the transport, timers and queued dispatch state, and every
+     *        other proxy sharing the connection.
+     *
+     * QObject::moveToThread() alone leaves the connection behind and is not
+     * supported. May be called from any thread; when called from another
+     * thread than the proxy's, blocks until the proxy's thread has carried
+     * out the move, which must therefore be running an event loop.
+     *
+     * @return bool False if a proxy has a parent or the transport is owned
+     *         by another object, in which case nothing is moved.
+     */
+    bool migrate(QThread *thread);
+
+    /**
+     * @brief Finalizes the outstanding requests of this proxy within
+     *        @p timeout ms, e.g. before shutting down or restarting.
+     *
+     * With CancelPending a WFSCancel for every execute is written back to
+     * back before waiting. Requests still outstanding at the timeout
+     * complete locally with WFS_ERR_TIMEOUT, so their handlers, signals and
+     * the device command queue are finalized either way. The timeout runs
+     * on QXfsClock; a negative one waits for as long as it takes.
+     *
+     * Blocks like syncExecute().
+     *
+     * @return bool True if all requests completed before the timeout.
+     */
+    bool drain(int timeout, DrainPolicy policy = CancelPending);
+
+    /**
+     * @brief Calls @p handler for the events @p eventId (e.g.
+     *        WFS_EXEE_PIN_KEY, WFS_SRVE_IDC_MEDIAINSERTED) as soon as they
+     *        are decoded, on the I/O path.
+     *
+     * Skips the dispatch queue and the event loop pass it costs, so the
+     * handler runs ahead of frames still queued, on the connection's
+     * thread, and must be thread-safe and quick. Unless it returns true,
+     * the event is then dispatched as usual; consumed events reach no
+     * signal or request handler. Applies to every proxy of the device; may
+     * be called from any thread. Registrations end with this proxy.
+     *
+     * @return int Registration id for removeDirectHandler().
+     */
+    int addDirectHandler(const QString &eventId,
+                         const DirectHandler &handler);
+    void removeDirectHandler(int id);
+
+    /**
+     * @brief Journals the executes of this proxy to @p fileName, an empty
+     *        name switching the journal off.
+     *
+     * Every execute sent and completed is recorded in a memory-mapped file
+     * at the cost of a copy, so a restarted application learns from
+     * interruptedCommands() which commands were in flight when the
+     * previous one crashed, instead of reconciling the whole device. Each
+     * proxy needs a file of its own. Executes the journal cannot record,
+     * the disk being full say, are not sent and return an empty msgid.
+     *
+     * @return bool False if the file cannot be written or mapped.
+     */
+    bool setJournal(const QString &fileName);
+
+    /**
+     * @brief Returns the executes in flight when the previous user of the
+     *        journal stopped.
+     *
+     * They are kept in the journal, surviving further crashes, until
+     * clearInterruptedCommands() is called.
+     *
+     * @return QMap Journal keys, "<run>:<msgid>" with the uuid of the run
+     *         that sent the command, mapped to the command names; request
+     *         ids alone may repeat from one run to the next.
+     */
+    QMap<QString, QString> interruptedCommands() const;
+    void clearInterruptedCommands();
+
+    /**
+     * @brief Publishes the status and capabilities of the device into a
+     *        QXfsStateBoard other processes can read, or stops to.
+     *
+     * Applies to every proxy of the device. Capabilities are published
+     * whenever cached; the status after every getStatus() and, queried in
+     * the background, after every service or system event.
+     *
+     * @return bool False if the board cannot be created.
+     */
+    bool setStateBoard(bool enable);
+
 public slots:
     /**
      * @brief Retrieves device capabilities.
@@ -105,6 +341,11 @@ public slots:
      * If capabilities are not cached, fetches them from the device.
      *
      * @note Implementations may cache capabilities per device class.
+     *
+     * The cache follows the device: a WFS_SYSE_DEVICE_STATUS system event
+     * (e.g. the device back online after a swap) or a
+     * WFS_SRVE_<class>_CAPABILITIESCHANGED service event has it refreshed
+     * in the background, then capabilitiesChanged() emitted.
      */
     QVariantMap capabilities();
 
@@ -121,12 +362,42 @@ public slots:
      * @param category Category identifier (e.g., "status", "caps", "counters").
      * @param queryDetails Optional parameters to narrow the query.
      * @return QVariantMap Result map with category-specific fields.
+     *
+     * Blocks like syncExecute().
      */
     QVariantMap getInfo(const QString &category,
                         const QVariant &queryDetails = QVariant());
 
 protected:
-    const QMap<QString, QString> &pending() {return m_pending;}
+    /**
+     * @brief Constructs a device proxy attached to a (possibly shared)
+     *        connection.
+     *
+     * All proxies attached to one connection share its transport, frame
+     * decoder, dispatch table and device-wide command queue.
+     */
+    explicit QXfsStream(const QSharedPointer<QXfsConnection> &connection,
+                        const QString &deviceId, const QString &strClass,
+                        QObject *parent = nullptr);
+
+    /**
+     * @brief Returns the outstanding requests of this proxy.
+     *
+     * @return QMap Request ids mapped to their command names.
+     */
+    QMap<QString, QString> pending() const;
+
+    /**
+     * @brief Returns the connection this proxy is attached to.
+     */
+    QXfsConnection *connection() const {return m_connection.data();}
+
+    /**
+     * @brief Routes a locally synthesized frame as if it was received.
+     *
+     * @param msg Frame payload; correlated through its msgid.
+     */
+    void deliver(const QVariantMap &msg);
 
     /**
      * @brief Queries the backend for a fresh status snapshot.
@@ -142,6 +413,21 @@ protected:
      */
     void getCapabilities();
 
+    /**
+     * @brief Refreshes the cached capabilities without blocking.
+     *
+     * Requests already under way absorb further calls.
+     */
+    void refreshCapabilities();
+
+    /**
+     * @brief Publishes a fresh status into the state board without
+     *        blocking, if there is one.
+     *
+     * Requests already under way absorb further calls.
+     */
+    void refreshStatus();
+
     /**
      * @brief Hook for device/service-originated events.
      *
@@ -182,55 +468,50 @@ protected:
     /**
      * @brief Attempts to establish a connection to the backend service.
      *
+     * Reopens the transport if it was closed, see QXfsConnection::open().
+     *
      * @return bool True on successful connection; otherwise false.
      */
-    virtual bool connectToServer(QIODevice *) {return true;}
+    virtual bool connectToServer(QIODevice *io);
+
+    virtual bool event(QEvent *e);
 
 private:
     /**
-     * @brief The underlying I/O transport. Typically a QLocalSocket or SSL.
+     * @brief The connection carrying the traffic of this proxy.
      *
-     * May be null until connectToServer() succeeds.
+     * Shared with the other proxies of the same device, if any.
      */
-    QIODevice *m_io;
+    QSharedPointer<QXfsConnection> m_connection;
 
     /**
-     * @brief Device class discriminator used to segment capability caches.
+     * @brief Device class descriptor (class discriminator, status and
+     *        capability categories), shared by all proxies of the class.
      */
-    const QString m_strClass;
+    const QXfsStreamClass *m_class;
 
     /**
-     * @brief Category key used for status queries.
-     */
-    QString m_statusCategory;
-
-    /**
-     * @brief Category key used for capability queries.
+     * @brief Cache of capabilities, shared by all proxies of the device.
+     *
+     * Reduces repeated backend calls for shared, immutable capability data.
+     * Published as snapshots, so readers from any thread take no lock.
      */
-    QString m_capabilitiesCategory;
+    QSharedPointer<QXfsSnapshot<QXfsCachedCapabilities>> m_capabilities;
 
     /**
-     * @brief Map of pending request ids to command names.
-     *
-     * Used to correlate inbound responses with outstanding operations.
+     * @brief True while refreshCapabilities() awaits the device.
      */
-    QMap<QString, QString> m_pending;
+    bool m_refreshingCapabilities;
 
     /**
-     * @brief Static cache of capabilities per device class.
-     *
-     * Reduces repeated backend calls for shared, immutable capability data.
+     * @brief True while refreshStatus() awaits the device.
      */
-    static QMap<QString, QVariantMap> m_capabilities;
-
-private slots:
+    bool m_refreshingStatus;
 
     /**
-     * @brief Slot invoked when the socket has data to read.
-     *
-     * Parses inbound frames and routes them to the proper handlers or signals.
+     * @brief Journal of the executes in flight, if enabled.
      */
-    void readyRead();
+    QScopedPointer<QXfsJournal> m_journal;
 
 signals:
     /**
@@ -293,6 +574,14 @@ signals:
      */
     void userEventRecieved(const QVariantMap &msg);
 
+    /**
+     * @brief Emitted by every proxy of the connection when a refresh
+     *        published new capabilities.
+     *
+     * @param caps The capabilities now cached.
+     */
+    void capabilitiesChanged(const QVariantMap &caps);
+
     /**
      * @brief Emitted for system-level events tied to a command context.
      *
@@ -304,24 +593,16 @@ signals:
                              const QVariant &lpCmdData);
 
 private:
-    /**
-     * @brief Returns the command currently at the head of the queue.
-     *
-     * @return QPair&lt;QString, QVariant&gt; The command id and payload.
-     */
-    QPair<QString, QVariant> currentCommand() const;
+    friend class QXfsConnection;
 
     /**
-     * @brief Appends a command to the pending queue.
+     * @brief Routes an inbound frame to the event hooks and signals.
      *
-     * @param cmd Pair of command id and payload.
-     */
-    void appendCommand(const QPair<QString, QVariant> &cmd) const;
-
-    /**
-     * @brief Completes and removes the current command from the queue.
+     * Called by the connection for every frame addressed to this proxy.
+     *
+     * @param msg Frame payload.
      */
-    void finishCommand() const;
+    void receive(const QVariantMap &msg);
 
     /**
      * @brief Low-level send routine for commands and data.
@@ -329,10 +610,12 @@ private:
      * @param function High-level action name (execute/cancel/etc.).
      * @param dwCommand Command code or descriptor.
      * @param lpCmdData Arbitrary payload for the operation.
+     * @param handler Invoked for every frame answering the request.
      * @return QString Request id generated for this transmission.
      */
     QString send(const QString &function, const QString &dwCommand,
-                 const QVariant &lpCmdData);
+                 const QVariant &lpCmdData,
+                 const std::function<void(const QVariantMap &)> &handler);
 
     /**
      * @brief Marks a request as completed and performs cleanup.
@@ -340,6 +623,20 @@ private:
      * @param msgid The request id to finalize.
      */
     void done(const QString &msgid);
+
+    /**
+     * @brief Wakes the caller of a blocking request.
+     */
+    using Wake = std::function<void()>;
+
+    /**
+     * @brief Runs @p start on the proxy's thread and blocks the calling
+     *        thread until the request it issued calls its wake function.
+     *
+     * Spins a local event loop when called on the proxy's thread, sleeps on
+     * a semaphore otherwise. @p start returns false if it issued nothing.
+     */
+    void await(const std::function<bool(const Wake &)> &start);
 };
 
 #endif // QXFSSTREAM_H
@@ -0,0 +1,293 @@
+#include <QRandomGenerator>
+#include <QRunnable>
+#include <QThreadPool>
+
+#include <algorithm>
+
+#include "benchmark.h"
+#include "qxfsclock.h"
+#include "qxfsstream.h"
+
+/**
+ * @class BenchmarkWorker
+ * @brief Closed loop worker, issuing one request after the other until the
+ *        benchmark ends.
+ */
+class BenchmarkWorker : public QRunnable
+{
+public:
+    BenchmarkWorker(Benchmark *benchmark, int index) :
+        m_benchmark(benchmark),
+        m_index(index)
+    {
+    }
+
+    virtual void run()
+    {
+        Benchmark *b = m_benchmark;
+        QRandomGenerator random(quint32(m_index) + 1);
+        const qint64 end = b->m_options.durationMs * Q_INT64_C(1000000);
+        int i = m_index;
+
+        for (;;)
+        {
+            const qint64 start = b->elapsed();
+
+            if (start >= end)
+                return;
+
+            Benchmark::Operation operation = b->pick(random.generate());
+            QXfsStream *stream = b->m_streams[i++ % b->m_streams.size()];
+
+            b->record(operation, start, b->perform(operation, stream));
+        }
+    }
+
+private:
+    Benchmark *m_benchmark;
+    int m_index;
+};
+
+/**
+ * @class BenchmarkRequest
+ * @brief Open loop request, timed from the moment it was due.
+ */
+class BenchmarkRequest : public QRunnable
+{
+public:
+    BenchmarkRequest(Benchmark *benchmark, qint64 due, quint32 random,
+                     int index) :
+        m_benchmark(benchmark),
+        m_due(due),
+        m_random(random),
+        m_index(index)
+    {
+    }
+
+    virtual void run()
+    {
+        Benchmark *b = m_benchmark;
+        Benchmark::Operation operation = b->pick(m_random);
+        QXfsStream *stream = b->m_streams[m_index % b->m_streams.size()];
+
+        b->record(operation, m_due, b->perform(operation, stream));
+    }
+
+private:
+    Benchmark *m_benchmark;
+    qint64 m_due;
+    quint32 m_random;
+    int m_index;
+};
+
+static const char *operationNames[] = {"execute", "getInfo", "cancel"};
+
+Benchmark::Benchmark(const BenchmarkOptions &options,
+                     const QList<QXfsStream *> &streams) :
+    m_options(options),
+    m_streams(streams),
+    m_start(0),
+    m_elapsed(0)
+{
+    Q_ASSERT(!m_streams.isEmpty());
+}
+
+void
+Benchmark::run()
+{
+    m_start = QXfsClock::instance()->nsecsElapsed();
+
+    if (m_options.mode == BenchmarkOptions::OpenLoop)
+        openLoop();
+    else
+        closedLoop();
+
+    m_elapsed = elapsed();
+}
+
+void
+Benchmark::closedLoop()
+{
+    QThreadPool pool;
+
+    pool.setMaxThreadCount(m_options.concurrency);
+
+    for (int i = 0; i < m_options.concurrency; i++)
+        pool.start(new BenchmarkWorker(this, i));
+
+    pool.waitForDone();
+}
+
+void
+Benchmark::openLoop()
+{
+    QThreadPool pool;
+    QRandomGenerator random;
+    const qint64 interval = qMax(qint64(1e9 / m_options.rate), qint64(1));
+    const qint64 end = m_options.durationMs * Q_INT64_C(1000000);
+
+    pool.setMaxThreadCount(m_options.concurrency);
+
+    for (qint64 due = 0, i = 0; due < end; due += interval, i++)
+    {
+        const qint64 wait = due - elapsed();
+
+        if (wait > 0)
+            QThread::usleep(wait / 1000);
+
+        /* requests queue up in the pool while all workers are busy; their
+         * latency still counts from the time they were due
+         */
+        pool.start(new BenchmarkRequest(this, due, random.generate(),
+                                        int(i)));
+    }
+
+    pool.waitForDone();
+}
+
+qint64
+Benchmark::elapsed() const
+{
+    return QXfsClock::instance()->nsecsElapsed() - m_start;
+}
+
+Benchmark::Operation
+Benchmark::pick(quint32 random) const
+{
+    const int total = m_options.executeWeight + m_options.getInfoWeight +
+                      m_options.cancelWeight;
+    int n = int(random % quint32(qMax(total, 1)));
+
+    if ((n -= m_options.executeWeight) < 0)
+        return Execute;
+    else if ((n -= m_options.getInfoWeight) < 0)
+        return GetInfo;
+
+    return Cancel;
+}
+
+bool
+Benchmark::perform(Operation operation, QXfsStream *stream)
+{
+    switch (operation)
+    {
+    case Execute:
+        return stream->syncExecute(m_options.command)["hResult"] ==
+               "WFS_SUCCESS";
+    case GetInfo:
+        return stream->getInfo(m_options.category)["hResult"] ==
+               "WFS_SUCCESS";
+    default:
+        break;
+    }
+
+    QString msgid;
+
+    /* execute() is asynchronous and must be issued on the proxy's thread */
+    QMetaObject::invokeMethod(stream, [&]
+    {
+        msgid = stream->execute(m_options.command);
+    }, Qt::BlockingQueuedConnection);
+
+    return !msgid.isEmpty() && stream->syncCancel(msgid);
+}
+
+void
+Benchmark::record(Operation operation, qint64 start, bool ok)
+{
+    const qint64 latency = elapsed() - start;
+
+    if (start < m_options.warmupMs * Q_INT64_C(1000000))
+        return;
+
+    QMutexLocker lock(&m_mutex);
+    Result &result = m_results[operation];
+
+    result.latencies.append(latency);
+
+    if (!ok)
+        result.errors++;
+}
+
+QJsonObject
+Benchmark::report() const
+{
+    QMutexLocker lock(&m_mutex);
+    const double seconds =
+            qMax(m_elapsed - m_options.warmupMs * Q_INT64_C(1000000),
+                 Q_INT64_C(1)) / 1e9;
+    QJsonObject operations;
+    Result total;
+
+    for (int i = 0; i < OperationCount; i++)
+    {
+        const Result &result = m_results[i];
+
+        if (result.latencies.isEmpty())
+            continue;
+
+        operations.insert(operationNames[i], summarize(result, seconds));
+
+        total.latencies += result.latencies;
+        total.errors += result.errors;
+    }
+
+    QJsonObject rv
+    {
+        {"mode", m_options.mode == BenchmarkOptions::OpenLoop ? "open"
+                                                              : "closed"},
+        {"devices", m_streams.size()},
+        {"concurrency", m_options.concurrency},
+        {"durationMs", m_options.durationMs},
+        {"warmupMs", m_options.warmupMs},
+        {"elapsed", m_elapsed / 1e9},
+        {"operations", operations},
+        {"total", summarize(total, seconds)}
+    };
+
+    if (m_options.mode == BenchmarkOptions::OpenLoop)
+        rv.insert("rate", m_options.rate);
+
+    return rv;
+}
+
+QJsonObject
+Benchmark::summarize(const Result &result, double seconds)
+{
+    QVector<qint64> latencies = result.latencies;
+    const int n = latencies.size();
+    QJsonObject percentiles;
+    double sum = 0;
+
+    std::sort(latencies.begin(), latencies.end());
+
+    foreach (qint64 latency, latencies)
+        sum += latency;
+
+    auto ms = [](qint64 ns) {return ns / 1e6;};
+    auto percentile = [&](double p)
+    {
+        return ms(latencies[qBound(0, int(p * n + 0.5) - 1, n - 1)]);
+    };
+
+    if (n)
+    {
+        percentiles =
+        {
+            {"p50", percentile(0.50)},
+            {"p90", percentile(0.90)},
+            {"p99", percentile(0.99)},
+            {"p999", percentile(0.999)},
+            {"max", ms(latencies.last())},
+            {"mean", sum / n / 1e6}
+        };
+    }
+
+    return
+    {
+        {"count", n},
+        {"errors", result.errors},
+        {"throughput", n / seconds},
+        {"latencyMs", percentiles}
+    };
+}
@@ -0,0 +1,119 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QJsonObject>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+
+class QXfsStream;
+
+/**
+ * @brief Benchmark settings, as given on the command line.
+ */
+struct BenchmarkOptions
+{
+    enum Mode
+    {
+        ClosedLoop,
+        OpenLoop
+    };
+
+    Mode mode = ClosedLoop;
+
+    /**
+     * @brief Requests in flight (closed loop) or worker threads issuing
+     *        them (open loop).
+     */
+    int concurrency = 1;
+
+    /**
+     * @brief Requests per second issued in open loop mode.
+     */
+    double rate = 100;
+
+    int durationMs = 10000;
+    int warmupMs = 0;
+
+    /**
+     * @brief Relative weights of execute, getInfo and cancel requests.
+     */
+    int executeWeight = 1;
+    int getInfoWeight = 0;
+    int cancelWeight = 0;
+
+    QString command;
+    QString category;
+};
+
+/**
+ * @class Benchmark
+ * @brief Drives the proxies from worker threads and collects latencies.
+ *
+ * @details
+ * The proxies stay on the thread that created them, which must keep
+ * running its event loop; workers issue blocking requests against them.
+ *
+ * In closed loop mode every worker issues its next request once the
+ * previous one completed. In open loop mode requests are issued at a
+ * fixed rate regardless of completions and latency is measured from the
+ * intended start, so a saturated server shows as queueing delay instead of
+ * a reduced request rate.
+ */
+class Benchmark : public QThread
+{
+public:
+    Benchmark(const BenchmarkOptions &options,
+              const QList<QXfsStream *> &streams);
+
+    /**
+     * @brief Throughput and latency percentiles of the finished run.
+     */
+    QJsonObject report() const;
+
+protected:
+    virtual void run();
+
+private:
+    friend class BenchmarkRequest;
+    friend class BenchmarkWorker;
+
+    enum Operation
+    {
+        Execute,
+        GetInfo,
+        Cancel,
+        OperationCount
+    };
+
+    struct Result
+    {
+        QVector<qint64> latencies;
+        qint64 errors = 0;
+    };
+
+    void closedLoop();
+    void openLoop();
+
+    Operation pick(quint32 random) const;
+    bool perform(Operation operation, QXfsStream *stream);
+    void record(Operation operation, qint64 start, bool ok);
+
+    static QJsonObject summarize(const Result &result, double seconds);
+
+    /**
+     * @brief Nanoseconds since the run started, on QXfsClock.
+     */
+    qint64 elapsed() const;
+
+    BenchmarkOptions m_options;
+    QList<QXfsStream *> m_streams;
+
+    qint64 m_start;
+    qint64 m_elapsed;
+
+    mutable QMutex m_mutex;
+    Result m_results[OperationCount];
+};
+
+#endif // BENCHMARK_H
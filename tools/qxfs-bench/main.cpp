@@ -0,0 +1,428 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonDocument>
+#include <QLocalSocket>
+#include <QTextStream>
+#include <QTimer>
+
+#include <limits>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#if defined(Q_OS_UNIX)
+#include <unistd.h>
+#endif
+
+#include "benchmark.h"
+#include "mockserver.h"
+#include "qxfsclock.h"
+#include "qxfsfaultdevice.h"
+#include "qxfssocketstream.h"
+#include "qxfsstatistics.h"
+
+/**
+ * @brief Time the requests of a run with injected disconnects have to
+ *        complete after it ended.
+ */
+static const int faultGraceMs = 30000;
+
+/**
+ * @brief Opens a connection of its own to the local server of @p device,
+ *        through a QXfsFaultDevice dropping it with probability
+ *        @p disconnect if that is not negative.
+ *
+ * @return QIODevice The transport, owning the socket; nullptr on failure.
+ */
+static QIODevice *
+connectLocal(const QString &device, double disconnect, quint32 seed)
+{
+    QLocalSocket *socket = new QLocalSocket;
+
+    socket->connectToServer("printec.ndc.device." + device);
+
+    if (!socket->waitForConnected())
+    {
+        qCritical("%s - unable to connect: %s", qPrintable(device),
+                  qPrintable(socket->errorString()));
+        delete socket;
+        return nullptr;
+    }
+
+    if (disconnect < 0)
+        return socket;
+
+    QXfsFaultDevice *transport = new QXfsFaultDevice(socket);
+
+    /* the socket goes away with the decorator, after it */
+    socket->setParent(transport);
+    transport->setDisconnectProbability(disconnect);
+    transport->setSeed(seed);
+
+    return transport;
+}
+
+/**
+ * @brief Resident set size and heap in use of the process, in bytes; 0
+ *        where the platform does not tell.
+ */
+static QPair<qint64, qint64>
+memoryUsage()
+{
+    qint64 rss = 0;
+    qint64 heap = 0;
+
+#if defined(Q_OS_LINUX)
+    QFile statm("/proc/self/statm");
+
+    if (statm.open(QIODevice::ReadOnly))
+        rss = statm.readAll().split(' ').value(1).toLongLong() *
+              sysconf(_SC_PAGESIZE);
+#endif
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    heap = qint64(mallinfo2().uordblks);
+#elif defined(__GLIBC__)
+    heap = mallinfo().uordblks;
+#endif
+
+    return {rss, heap};
+}
+
+/**
+ * @brief Parses a request mix such as "execute:80,getinfo:15,cancel:5".
+ */
+static bool
+parseMix(const QString &mix, BenchmarkOptions &options)
+{
+    options.executeWeight = 0;
+    options.getInfoWeight = 0;
+    options.cancelWeight = 0;
+
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+    const QStringList &entries = mix.split(',', Qt::SkipEmptyParts);
+#else
+    const QStringList &entries = mix.split(',', QString::SkipEmptyParts);
+#endif
+
+    foreach (const QString &entry, entries)
+    {
+        const QStringList &pair = entry.split(':');
+        bool ok;
+        int weight = pair.value(1, "1").toInt(&ok);
+        const QString name = pair[0].trimmed().toLower();
+
+        if (!ok || weight < 0)
+            return false;
+
+        if (name == "execute")
+            options.executeWeight = weight;
+        else if (name == "getinfo")
+            options.getInfoWeight = weight;
+        else if (name == "cancel")
+            options.cancelWeight = weight;
+        else
+            return false;
+    }
+
+    return options.executeWeight + options.getInfoWeight +
+           options.cancelWeight > 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+
+    app.setApplicationName("qxfs-bench");
+
+    parser.setApplicationDescription("Load generator for XFS device servers, "
+                                     "reporting throughput and latency "
+                                     "percentiles as JSON.");
+    parser.addHelpOption();
+    parser.addOptions({
+        {"address", "Device server: local, tcp://host:port or "
+         "ssl://host:port.", "address", "local"},
+        {"class", "Device class.", "class", "CDM"},
+        {"devices", "Number of devices, named <prefix>1..<prefix>N.",
+         "n", "1"},
+        {"prefix", "Device id prefix; defaults to the device class.",
+         "prefix"},
+        {"concurrency", "Requests in flight (closed loop) or worker threads "
+         "(open loop).", "m", "1"},
+        {"mode", "closed or open loop.", "mode", "closed"},
+        {"rate", "Requests per second in open loop mode.", "rate", "100"},
+        {"duration", "Measured duration in seconds.", "s", "10"},
+        {"warmup", "Seconds excluded from the measurement.", "s", "0"},
+        {"mix", "Request weights, e.g. execute:80,getinfo:15,cancel:5.",
+         "mix", "execute:1"},
+        {"command", "Command issued by execute and cancel requests.",
+         "command"},
+        {"category", "Category queried by getInfo requests.", "category"},
+        {"framing", "legacy or length.", "framing", "legacy"},
+        {"mock", "Serve the devices from a built-in mock server."},
+        {"mock-delay", "Execute duration of the mock server in ms.", "ms",
+         "10"},
+        {"simulate", "Run on virtual time against the mock server, e.g. "
+         "for soak runs of hours: closed loop only, reproducible with a "
+         "concurrency of 1."},
+        {"proxies", "Proxies per device, reported with the memory they "
+         "take.", "n", "1"},
+        {"unshared", "Give every proxy a connection of its own instead of "
+         "one per device (local device servers only)."},
+        {"disconnect", "Route the local connections through QXfsFaultDevice, "
+         "dropping them after a segment with probability p: checks that "
+         "requests fail and the proxies reconnect instead of hanging.",
+         "p"},
+        {"output", "Write the report to a file instead of stdout.", "file"}
+    });
+    parser.process(app);
+
+    BenchmarkOptions options;
+    const QString strClass = parser.value("class").toUpper();
+    const QString prefix = parser.isSet("prefix") ? parser.value("prefix")
+                                                  : strClass;
+    const QXfsStream::Framing framing =
+            parser.value("framing") == "length"
+            ? QXfsStream::LengthPrefixedFraming
+            : QXfsStream::LegacyFraming;
+    QStringList devices;
+
+    options.mode = parser.value("mode") == "open"
+                   ? BenchmarkOptions::OpenLoop
+                   : BenchmarkOptions::ClosedLoop;
+    options.concurrency = qMax(parser.value("concurrency").toInt(), 1);
+    options.rate = qMax(parser.value("rate").toDouble(), 0.001);
+    options.durationMs = int(parser.value("duration").toDouble() * 1000);
+    options.warmupMs = int(parser.value("warmup").toDouble() * 1000);
+    options.durationMs += options.warmupMs;
+    options.command = parser.isSet("command")
+                      ? parser.value("command")
+                      : "WFS_CMD_" + strClass + "_RESET";
+    options.category = parser.isSet("category")
+                       ? parser.value("category")
+                       : "WFS_INF_" + strClass + "_STATUS";
+
+    if (!parseMix(parser.value("mix"), options))
+    {
+        qCritical("invalid request mix: %s",
+                  qPrintable(parser.value("mix")));
+        return 1;
+    }
+
+    for (int i = 1; i <= qMax(parser.value("devices").toInt(), 1); i++)
+        devices.append(prefix + QString::number(i));
+
+    const bool simulate = parser.isSet("simulate");
+
+    if (simulate && options.mode == BenchmarkOptions::OpenLoop)
+    {
+        qCritical("--simulate runs in closed loop only");
+        return 1;
+    }
+
+    /* installed before anything arms a timer: the mock server's delays,
+     * the proxies' timeouts and the measured duration all pass in virtual
+     * time, which only moves when nothing else is left to do
+     */
+    QXfsSimulatedClock clock;
+
+    if (simulate)
+        QXfsClock::install(&clock);
+
+    QThread mockThread;
+    MockServer *mock = nullptr;
+    QString address = parser.value("address");
+
+    if (parser.isSet("mock") || simulate)
+    {
+        bool listening = false;
+
+        mock = new MockServer(devices, framing,
+                              parser.value("mock-delay").toInt());
+
+        if (simulate)
+            listening = mock->listen();
+        else
+        {
+            mock->moveToThread(&mockThread);
+            mockThread.setObjectName("qxfs-bench-mock");
+            mockThread.start();
+
+            QMetaObject::invokeMethod(mock, "listen",
+                                      Qt::BlockingQueuedConnection,
+                                      Q_RETURN_ARG(bool, listening));
+        }
+
+        if (!listening)
+        {
+            mockThread.quit();
+            mockThread.wait();
+            delete mock;
+            return 1;
+        }
+
+        address = "local";
+    }
+
+    const bool faults = parser.isSet("disconnect");
+    const bool unshared = parser.isSet("unshared");
+    const int proxies = qMax(parser.value("proxies").toInt(), 1);
+
+    if ((faults || unshared) && address != "local")
+    {
+        qCritical("--disconnect and --unshared need local device servers");
+        return 1;
+    }
+
+    QList<QXfsStream *> streams;
+    QList<QIODevice *> transports;
+    const QPair<qint64, qint64> &before = memoryUsage();
+
+    foreach (const QString &device, devices)
+    {
+        for (int i = 0; i < proxies; i++)
+        {
+            QXfsStream *stream;
+
+            if (faults || unshared)
+            {
+                QIODevice *transport =
+                        connectLocal(device,
+                                     faults ? parser.value("disconnect")
+                                              .toDouble() : -1,
+                                     quint32(transports.size()) + 1);
+
+                if (!transport)
+                    return 1;
+
+                transports.append(transport);
+                stream = new QXfsStream(transport, device, strClass);
+            }
+            else
+                stream = new QXfsSocketStream(address, device, strClass);
+
+            stream->setFraming(framing);
+            streams.append(stream);
+        }
+    }
+
+    const QPair<qint64, qint64> &after = memoryUsage();
+
+    /* the proxies stay on this thread, which keeps serving their traffic
+     * while the benchmark's workers block on requests
+     */
+    Benchmark benchmark(options, streams);
+
+    QObject::connect(&benchmark, &QThread::finished,
+                     &app, &QCoreApplication::quit);
+    benchmark.start();
+
+    /* a request no disconnect ever completes keeps its worker blocked;
+     * not simulated, where the timer would be the next thing due
+     */
+    if (faults && !simulate)
+    {
+        QTimer::singleShot(options.durationMs + faultGraceMs, &app,
+                           [&benchmark]
+        {
+            if (!benchmark.isFinished())
+                qFatal("requests still outstanding after disconnects");
+        });
+    }
+
+    if (simulate)
+    {
+        clock.runUntil([&benchmark] {return benchmark.isFinished();},
+                       std::numeric_limits<qint64>::max());
+    }
+    else
+        app.exec();
+
+    benchmark.wait();
+
+    QJsonObject report = benchmark.report();
+    const QVariantMap &stats = QXfsStatistics::snapshot()["devices"].toMap();
+
+    if (faults)
+    {
+        qint64 disconnects = 0;
+        qint64 reconnects = 0;
+
+        foreach (const QString &device, devices)
+        {
+            disconnects += stats[device].toMap()["disconnects"].toLongLong();
+            reconnects += stats[device].toMap()["reconnects"].toLongLong();
+        }
+
+        report.insert("faults", QJsonObject
+        {
+            {"disconnectProbability", parser.value("disconnect").toDouble()},
+            {"disconnects", disconnects},
+            {"reconnects", reconnects}
+        });
+    }
+
+    /* allocations are only counted by builds with allocation accounting,
+     * on the send, dispatch and decode paths of the requests
+     */
+    const qint64 requests =
+            report["total"].toObject()["count"].toVariant().toLongLong();
+    qint64 allocations = 0;
+
+    foreach (const QString &device, devices)
+    {
+        foreach (const QVariant &path,
+                 stats[device].toMap()["allocations"].toMap())
+            allocations += path.toMap()["count"].toLongLong();
+    }
+
+    QJsonObject memory
+    {
+        {"proxiesPerDevice", proxies},
+        {"shared", !(faults || unshared)},
+        {"rssBytesPerProxy",
+         double(after.first - before.first) / streams.size()},
+        {"heapBytesPerProxy",
+         double(after.second - before.second) / streams.size()}
+    };
+
+    if (QXfsStatistics::allocationAccounting())
+        memory.insert("allocationsPerRequest",
+                      double(allocations) / qMax(requests, Q_INT64_C(1)));
+
+    report.insert("memory", memory);
+
+    qDeleteAll(streams);
+    qDeleteAll(transports);
+
+    if (mock)
+    {
+        mockThread.quit();
+        mockThread.wait();
+        delete mock;
+    }
+
+    const QByteArray &json =
+            QJsonDocument(report).toJson(QJsonDocument::Indented);
+
+    if (parser.isSet("output"))
+    {
+        QFile file(parser.value("output"));
+
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            qCritical("%s: %s", qPrintable(file.fileName()),
+                      qPrintable(file.errorString()));
+            return 1;
+        }
+
+        file.write(json);
+    }
+    else
+        QTextStream(stdout) << json;
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <QDataStream>
+#include <QtEndian>
+
+#include "mockserver.h"
+#include "qxfsclock.h"
+
+MockServer::MockServer(const QStringList &devices,
+                       QXfsStream::Framing framing, int executeDelayMs,
+                       QObject *parent) :
+    QObject{parent},
+    m_devices(devices),
+    m_framing(framing),
+    m_executeDelay(executeDelayMs)
+{
+}
+
+bool
+MockServer::listen()
+{
+    foreach (const QString &device, m_devices)
+    {
+        QLocalServer *server = new QLocalServer(this);
+        const QString name = "printec.ndc.device." + device;
+
+        QLocalServer::removeServer(name);
+
+        if (!server->listen(name))
+        {
+            qCritical("%s - unable to listen: %s", qPrintable(name),
+                      qPrintable(server->errorString()));
+            return false;
+        }
+
+        connect(server, SIGNAL(newConnection()), SLOT(newConnection()));
+    }
+
+    return true;
+}
+
+void
+MockServer::newConnection()
+{
+    QLocalServer *server = static_cast<QLocalServer *>(sender());
+
+    while (QLocalSocket *socket = server->nextPendingConnection())
+    {
+        connect(socket, SIGNAL(readyRead()), SLOT(readyRead()));
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    }
+}
+
+void
+MockServer::readyRead()
+{
+    QLocalSocket *socket = static_cast<QLocalSocket *>(sender());
+
+    for (;;)
+    {
+        QVariantMap cmd;
+
+        if (m_framing == QXfsStream::LengthPrefixedFraming)
+        {
+            if (socket->bytesAvailable() < qint64(sizeof(quint32)))
+                return;
+
+            const quint32 size =
+                    qFromBigEndian<quint32>(socket->peek(sizeof(quint32))
+                                            .constData());
+
+            if (socket->bytesAvailable() < qint64(sizeof(quint32) + size))
+                return;
+
+            socket->read(sizeof(quint32));
+
+            QDataStream ds(socket->read(size));
+
+            ds.setByteOrder(QDataStream::BigEndian);
+            ds >> cmd;
+        }
+        else
+        {
+            QDataStream ds(socket);
+
+            ds.setByteOrder(QDataStream::BigEndian);
+            ds.startTransaction();
+            ds >> cmd;
+
+            if (!ds.commitTransaction())
+                return;
+        }
+
+        handle(socket, cmd);
+    }
+}
+
+void
+MockServer::handle(QLocalSocket *socket, const QVariantMap &cmd)
+{
+    const QString function = cmd["function"].toString();
+    const QString msgid = cmd["msgid"].toString();
+    const QString dwCommand = cmd["dwCommand"].toString();
+
+    if (function == "WFSExecute")
+    {
+        reply(socket, {
+            {"msgid", msgid},
+            {"hResult", "WFS_SUCCESS"},
+            {"dwCommandCode", dwCommand}
+        });
+
+        m_executions.insert(msgid, {socket, dwCommand});
+
+        QXfsTimer::singleShot(m_executeDelay, this, [this, msgid]
+        {
+            complete(msgid, "WFS_SUCCESS");
+        });
+    }
+    else if (function == "WFSGetInfo")
+    {
+        reply(socket, {
+            {"msgid", msgid},
+            {"hResult", "WFS_SUCCESS"},
+            {"message", "WFS_GETINFO_COMPLETE"},
+            {"dwCommandCode", dwCommand},
+            {"lpBuffer", QVariantMap()}
+        });
+    }
+    else if (function == "WFSCancel")
+    {
+        const QString requestId = cmd["RequestID"].toString();
+        bool running = m_executions.contains(requestId);
+
+        if (running)
+            complete(requestId, "WFS_ERR_CANCELED");
+
+        reply(socket, {
+            {"msgid", msgid},
+            {"hResult", running ? "WFS_SUCCESS" : "WFS_ERR_INVALID_REQ_ID"}
+        });
+    }
+    else
+    {
+        reply(socket, {
+            {"msgid", msgid},
+            {"hResult", "WFS_ERR_UNSUPP_COMMAND"}
+        });
+    }
+}
+
+void
+MockServer::complete(const QString &msgid, const QString &hResult)
+{
+    const Execution execution = m_executions.take(msgid);
+
+    if (!execution.socket)
+        return;
+
+    reply(execution.socket, {
+        {"msgid", msgid},
+        {"hResult", hResult},
+        {"message", "WFS_EXECUTE_COMPLETE"},
+        {"dwCommandCode", execution.dwCommand},
+        {"lpBuffer", QVariantMap()}
+    });
+}
+
+void
+MockServer::reply(QLocalSocket *socket, const QVariantMap &frame)
+{
+    QDataStream ds(socket);
+
+    ds.setByteOrder(QDataStream::BigEndian);
+
+    if (m_framing == QXfsStream::LengthPrefixedFraming)
+    {
+        QByteArray buf;
+        QDataStream bs(&buf, QIODevice::WriteOnly);
+
+        bs.setByteOrder(QDataStream::BigEndian);
+        bs << frame;
+
+        ds << quint32(buf.size());
+        ds.writeRawData(buf.constData(), buf.size());
+    }
+    else
+        ds << frame;
+}
@@ -0,0 +1,64 @@
+#ifndef MOCKSERVER_H
+#define MOCKSERVER_H
+
+#include <QHash>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QStringList>
+
+#include "qxfsstream.h"
+
+/**
+ * @class MockServer
+ * @brief Minimal device server answering on the local sockets of the
+ *        benchmarked devices.
+ *
+ * @details
+ * Acknowledges executes and completes them after a fixed delay, completes
+ * getInfo requests at once and cancels executes still running. Lives on a
+ * thread of its own so it does not compete with the benchmarked proxies,
+ * but on the proxies' thread when simulated (see --simulate), where the
+ * delays pass in virtual time.
+ */
+class MockServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    MockServer(const QStringList &devices, QXfsStream::Framing framing,
+               int executeDelayMs, QObject *parent = nullptr);
+
+    /**
+     * @brief Starts listening for every device.
+     *
+     * @return bool False if a device name could not be taken.
+     */
+    Q_INVOKABLE bool listen();
+
+private slots:
+    void newConnection();
+    void readyRead();
+
+private:
+    /**
+     * @brief Execute request waiting for its completion.
+     */
+    struct Execution
+    {
+        QPointer<QLocalSocket> socket;
+        QString dwCommand;
+    };
+
+    void handle(QLocalSocket *socket, const QVariantMap &cmd);
+    void complete(const QString &msgid, const QString &hResult);
+    void reply(QLocalSocket *socket, const QVariantMap &frame);
+
+    QStringList m_devices;
+    QXfsStream::Framing m_framing;
+    int m_executeDelay;
+
+    QHash<QString, Execution> m_executions;
+};
+
+#endif // MOCKSERVER_H
@@ -0,0 +1,28 @@
+CFGPRI=$$clean_path($$PWD/../../../qxfsconfig.pri)
+
+exists($$CFGPRI) {
+    include($$CFGPRI)
+}
+
+QT -= gui
+QT += network
+
+CONFIG -= depend_includepath app_bundle
+CONFIG += console c++11
+
+INCLUDEPATH += $$PWD/../.. $$INCLUDES
+DEPENDPATH += $$PWD/../.. $$INCLUDES
+
+TEMPLATE = app
+TARGET = qxfs-bench
+
+LIBS += -L$$OUT_PWD/../.. -lqxfs
+
+SOURCES += \
+    benchmark.cpp \
+    main.cpp \
+    mockserver.cpp
+
+HEADERS += \
+    benchmark.h \
+    mockserver.h
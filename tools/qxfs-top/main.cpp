@@ -0,0 +1,48 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+
+#include "qxfsstatistics.h"
+#include "top.h"
+
+int
+main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+
+    app.setApplicationName("qxfs-top");
+
+    parser.setApplicationDescription("Live per-device traffic of a process "
+                                     "using qxfs. The process must serve its "
+                                     "statistics, see QXfsStatistics::listen() "
+                                     "and QXFS_STATS.");
+    parser.addHelpOption();
+    parser.addOptions({
+        {{"p", "pid"}, "Process to inspect.", "pid"},
+        {{"n", "name"}, "Statistics server name, instead of a pid.", "name"},
+        {{"d", "delay"}, "Refresh interval in seconds.", "s", "1"},
+        {{"i", "iterations"}, "Refreshes before exiting, 0 for ever.", "n",
+         "0"},
+        {"json", "Print the raw snapshots as JSON lines."},
+        {"stages", "Switch the stage timers of the process on."}
+    });
+    parser.process(app);
+
+    QString name = parser.value("name");
+
+    if (name.isEmpty())
+    {
+        if (!parser.isSet("pid"))
+            parser.showHelp(1);
+
+        name = QXfsStatistics::serverName(parser.value("pid").toLongLong());
+    }
+
+    Top top(name, int(qMax(parser.value("delay").toDouble(), 0.1) * 1000),
+            qMax(parser.value("iterations").toInt(), 0),
+            parser.isSet("json"), parser.isSet("stages"));
+
+    top.start();
+
+    return app.exec();
+}
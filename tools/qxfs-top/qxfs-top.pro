@@ -0,0 +1,26 @@
+CFGPRI=$$clean_path($$PWD/../../../qxfsconfig.pri)
+
+exists($$CFGPRI) {
+    include($$CFGPRI)
+}
+
+QT -= gui
+QT += network
+
+CONFIG -= depend_includepath app_bundle
+CONFIG += console c++11
+
+INCLUDEPATH += $$PWD/../.. $$INCLUDES
+DEPENDPATH += $$PWD/../.. $$INCLUDES
+
+TEMPLATE = app
+TARGET = qxfs-top
+
+LIBS += -L$$OUT_PWD/../.. -lqxfs
+
+SOURCES += \
+    main.cpp \
+    top.cpp
+
+HEADERS += \
+    top.h
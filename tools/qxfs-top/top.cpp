@@ -0,0 +1,237 @@
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QTextStream>
+
+#include "qxfsstatistics.h"
+#include "top.h"
+
+Top::Top(const QString &name, int intervalMs, int iterations, bool json,
+         bool stages, QObject *parent) :
+    QObject{parent},
+    m_name(name),
+    m_iterations(iterations),
+    m_json(json),
+    m_stages(stages),
+    m_socket(this),
+    m_timer(this)
+{
+    m_timer.setInterval(intervalMs);
+
+    connect(&m_timer, SIGNAL(timeout()), SLOT(poll()));
+    connect(&m_socket, SIGNAL(connected()), SLOT(connected()));
+    connect(&m_socket, SIGNAL(readyRead()), SLOT(readyRead()));
+    connect(&m_socket, SIGNAL(disconnected()), SLOT(error()));
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    connect(&m_socket, &QLocalSocket::errorOccurred, this, &Top::error);
+#else
+    connect(&m_socket,
+            QOverload<QLocalSocket::LocalSocketError>::of(&QLocalSocket::error),
+            this, &Top::error);
+#endif
+}
+
+void
+Top::start()
+{
+    m_socket.connectToServer(m_name);
+    m_timer.start();
+}
+
+void
+Top::connected()
+{
+    if (m_stages)
+        m_socket.write("stages on\n");
+
+    poll();
+}
+
+void
+Top::poll()
+{
+    if (m_socket.state() == QLocalSocket::ConnectedState)
+        m_socket.write("snapshot\n");
+}
+
+void
+Top::error()
+{
+    QTextStream(stderr) << m_name << ": " << m_socket.errorString() << '\n';
+    QCoreApplication::exit(1);
+}
+
+void
+Top::readyRead()
+{
+    while (m_socket.canReadLine())
+    {
+        const QByteArray &line = m_socket.readLine();
+
+        if (m_json)
+            QTextStream(stdout) << line;
+        else
+            render(QJsonDocument::fromJson(line).toVariant().toMap());
+
+        if (m_iterations && --m_iterations == 0)
+        {
+            m_socket.disconnect(this);
+            QCoreApplication::quit();
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Stream manipulators aligning the following fields; those of Qt
+ *        are spelled differently since Qt 5.14.
+ */
+static QTextStream &
+alignLeft(QTextStream &s)
+{
+    s.setFieldAlignment(QTextStream::AlignLeft);
+    return s;
+}
+
+static QTextStream &
+alignRight(QTextStream &s)
+{
+    s.setFieldAlignment(QTextStream::AlignRight);
+    return s;
+}
+
+/**
+ * @brief Difference of two latency histograms, i.e. the latencies of the
+ *        requests completed in between.
+ */
+static QVariantList
+histogramDelta(const QVariantList &current, const QVariantList &previous)
+{
+    QVariantList rv;
+
+    for (int i = 0; i < current.size(); i++)
+    {
+        rv.append(current[i].toULongLong() -
+                  previous.value(i, 0).toULongLong());
+    }
+
+    return rv;
+}
+
+void
+Top::render(const QVariantMap &snapshot)
+{
+    /* the process' own clock, which may be a simulated one */
+    const qint64 now = snapshot["timestamp"].toLongLong();
+    const double seconds =
+            qMax(now - m_previous["timestamp"].toLongLong(), qint64(1)) /
+            1000.0;
+    const QVariantMap &devices = snapshot["devices"].toMap();
+    const QVariantMap &previous = m_previous["devices"].toMap();
+    QTextStream out(stdout);
+    QVariantMap::const_iterator it;
+
+    /* clear the screen and home the cursor */
+    out << "\033[H\033[2J";
+    out << m_name << " - "
+        << QDateTime::fromMSecsSinceEpoch(now).toString(Qt::ISODate)
+        << " - " << devices.size() << " devices\n\n";
+
+    out << qSetFieldWidth(16) << alignLeft << "DEVICE"
+        << qSetFieldWidth(10) << alignRight << "IN/s" << "OUT/s" << "DONE/s"
+        << "INFLIGHT" << "QUEUE" << "P50ms" << "P99ms" << "MAXms"
+        << "DISC" << "RECONN" << qSetFieldWidth(0) << "\n";
+
+    for (it = devices.cbegin(); it != devices.cend(); it++)
+    {
+        const QVariantMap &dev = it.value().toMap();
+        const QVariantMap &prev = previous[it.key()].toMap();
+        const QVariantList &histogram = histogramDelta(
+                    dev["latency"].toMap()["histogram"].toList(),
+                    prev["latency"].toMap()["histogram"].toList());
+
+        auto rate = [&](const char *counter)
+        {
+            if (prev.isEmpty())
+                return QString("-");
+
+            return QString::number((dev[counter].toULongLong() -
+                                    prev[counter].toULongLong()) / seconds,
+                                   'f', 1);
+        };
+        auto ms = [&](double p)
+        {
+            return QString::number(
+                        QXfsStatistics::percentile(histogram, p) / 1000.0,
+                        'f', 3);
+        };
+
+        out << qSetFieldWidth(16) << alignLeft << it.key()
+            << qSetFieldWidth(10) << alignRight
+            << rate("framesIn") << rate("framesOut") << rate("completed")
+            << dev["inFlight"].toString() << dev["queueDepth"].toString()
+            << ms(0.50) << ms(0.99) << ms(1)
+            << dev["disconnects"].toString() << dev["reconnects"].toString()
+            << qSetFieldWidth(0) << "\n";
+    }
+
+    if (snapshot["stageTimers"].toBool())
+    {
+        const QVariantMap &stages = snapshot["stages"].toMap();
+        const QVariantMap &prev = m_previous["stages"].toMap();
+        const double ticksPerNs = qMax(snapshot["ticksPerNs"].toDouble(),
+                                       1e-9);
+
+        out << "\nmean stage time (us) over the interval:";
+
+        foreach (const QString &stage, QStringList({"decode", "queue",
+                                                    "dispatch", "handler"}))
+        {
+            const QVariantMap &cur = stages[stage].toMap();
+            const QVariantMap &old = prev[stage].toMap();
+            const quint64 n = cur["count"].toULongLong() -
+                              old["count"].toULongLong();
+            const quint64 ticks = cur["ticks"].toULongLong() -
+                                  old["ticks"].toULongLong();
+
+            out << "  " << stage << " "
+                << (n ? QString::number(ticks / ticksPerNs / n / 1000, 'f', 2)
+                      : QString("-"));
+        }
+
+        out << "\n";
+    }
+
+    /* devices whose server reports timing fields */
+    for (it = devices.cbegin(); it != devices.cend(); it++)
+    {
+        const QVariantMap &server = it.value().toMap()["server"].toMap();
+        const QVariantMap &prev = previous[it.key()].toMap()["server"]
+                                  .toMap();
+        QString line;
+        bool timed = false;
+
+        foreach (const QString &phase, QStringList({"uplink", "queue",
+                                                    "device", "downlink"}))
+        {
+            const QVariantMap &cur = server[phase].toMap();
+            const QVariantMap &old = prev[phase].toMap();
+            const quint64 n = cur["count"].toULongLong() -
+                              old["count"].toULongLong();
+            const quint64 ns = cur["totalNs"].toULongLong() -
+                               old["totalNs"].toULongLong();
+
+            timed = timed || n;
+            line += "  " + phase + " " +
+                    (n ? QString::number(ns / 1e6 / n, 'f', 3)
+                       : QString("-"));
+        }
+
+        if (timed)
+            out << it.key() << " mean server phases (ms):" << line << "\n";
+    }
+
+    out.flush();
+
+    m_previous = snapshot;
+}
@@ -0,0 +1,54 @@
+#ifndef TOP_H
+#define TOP_H
+
+#include <QLocalSocket>
+#include <QTimer>
+#include <QVariantMap>
+
+/**
+ * @class Top
+ * @brief Polls the statistics server of a process and renders per device
+ *        rates, gauges and latency percentiles of the last interval.
+ */
+class Top : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @param name Statistics server name of the inspected process.
+     * @param intervalMs Refresh interval.
+     * @param iterations Number of refreshes before quitting, 0 for ever.
+     * @param json Print the raw snapshots instead of a table.
+     * @param stages Switch the stage timers of the process on.
+     */
+    Top(const QString &name, int intervalMs, int iterations, bool json,
+        bool stages, QObject *parent = nullptr);
+
+    void start();
+
+private slots:
+    void connected();
+    void poll();
+    void readyRead();
+    void error();
+
+private:
+    void render(const QVariantMap &snapshot);
+
+    QString m_name;
+    int m_iterations;
+    bool m_json;
+    bool m_stages;
+
+    QLocalSocket m_socket;
+    QTimer m_timer;
+
+    /**
+     * @brief Snapshot the rates of the next one are computed against, over
+     *        the time between their timestamps.
+     */
+    QVariantMap m_previous;
+};
+
+#endif // TOP_H